@@ -0,0 +1,30 @@
+#!/usr/bin/python3 -O
+
+'''
+合并训练语料中重复的样本，输出带权重的语料.
+
+每行格式为 "编码\t文本"，可以带第三列权重（默认为 1），
+相同的（编码，文本）合并为一行，权重相加，按首次出现的顺序输出 "编码\t文本\t权重".
+'''
+
+__author__ = '黄艺华'
+
+
+import sys
+import logging
+
+
+weights = {}
+for line in sys.stdin:
+    try:
+        fields = line.split()
+        if len(fields) >= 2:
+            key = (fields[0], fields[1])
+            weight = float(fields[2]) if len(fields) > 2 else 1.0
+            weights[key] = weights.get(key, 0.0) + weight
+
+    except Exception as e:
+        logging.error('{}:{}'.format(e, line))
+
+for (code, text), weight in weights.items():
+    print('{}\t{}\t{:g}'.format(code, text, weight))
@@ -0,0 +1,615 @@
+/**
+ * 性能测试.
+ */
+
+#include <cassert>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
+#include <iomanip>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "ime/common.h"
+#include "ime/dict.h"
+#include "ime/corpus.h"
+#include "ime/feature.h"
+#include "ime/decoder.h"
+#include "ime/flat_map.h"
+#include "ime/concurrent_map.h"
+#include "ime/bigram.h"
+#include "ime/bloom.h"
+#include "ime/report.h"
+#include "ime/perf.h"
+#include "ime/alloc.h"
+
+
+namespace
+{
+
+/**
+ * 估算 std::unordered_map 占用的内存，libstdc++ 的节点包含后继指针和键值对，整数键不缓存哈希值.
+ */
+size_t memory(const std::unordered_map<uint64_t, double> &weights)
+{
+    return weights.bucket_count() * sizeof(void *)
+        + weights.size() * (sizeof(void *) + sizeof(std::pair<const uint64_t, double>));
+}
+
+template<typename Function>
+double time_per_call(const std::vector<uint64_t> &keys, size_t rounds, Function f)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (auto key : keys)
+        {
+            f(key);
+        }
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(stop - start).count()
+        / (keys.size() * rounds);
+}
+
+/**
+ * 按特征模板列表解析 "name:取值" 形式的特征名，得到打包后的特征键.
+ */
+template<typename... Templates>
+bool parse_feature(const std::string &feature, const ime::Dictionary &dict, uint64_t &key)
+{
+    auto pos = feature.find(':');
+    if (pos == std::string::npos)
+    {
+        return false;
+    }
+
+    auto name = feature.substr(0, pos);
+    auto text = feature.substr(pos + 1);
+    uint64_t value;
+    return ((name == Templates::name && Templates::parse(text, dict, value)
+        && ((key = ime::feature_key(Templates::id, value)), true)) || ...);
+}
+
+/**
+ * 对比冻结后稀疏特征使用的 FlatIntegerWeightMap 和其他哈希表的查找性能.
+ *
+ * 默认特征集中 unigram 和 code_len 是 DENSE 模板，bigram 存放在 BigramTable 中，
+ * 冻结后的稀疏特征表几乎为空，这里把模型中所有特征的键放进各个哈希表，只比较哈希表本身
+ */
+void bench_weight_map(const ime::Dictionary &dict, const std::string &model_file)
+{
+    std::unordered_map<uint64_t, double> weights;
+    std::ifstream is(model_file);
+    while (!is.eof())
+    {
+        std::string line;
+        std::string feature;
+        double weight;
+        uint64_t key;
+
+        std::getline(is, line);
+        std::stringstream ss(line);
+        ss >> feature >> weight;
+        if (parse_feature<ime::UnigramTemplate, ime::BigramTemplate, ime::CodeLenTemplate>(feature, dict, key))
+        {
+            weights.emplace(key, weight);
+        }
+    }
+
+    ime::FlatIntegerWeightMap flat;
+    flat.build(std::vector<std::pair<uint64_t, double>>(weights.cbegin(), weights.cend()));
+
+    ime::ConcurrentWeightMap<uint64_t> concurrent;
+    for (auto &i : weights)
+    {
+        concurrent.emplace(i.first, i.second);
+    }
+
+    INFO << weights.size() << " features, memory: unordered_map = "
+        << memory(weights) << " bytes, flat map = " << flat.memory() << " bytes" << std::endl;
+
+    // 一半查询命中，一半不命中，不命中的键翻转取值的最高位，仍属于同一模板；打乱顺序避免顺序访问的缓存效应
+    std::vector<uint64_t> keys;
+    keys.reserve(weights.size() * 2);
+    for (auto &i : weights)
+    {
+        auto missing = i.first ^ (static_cast<uint64_t>(1) << (ime::feature_value_bits - 1));
+        keys.push_back(i.first);
+        if (weights.find(missing) == weights.cend())
+        {
+            keys.push_back(missing);
+        }
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+
+    size_t rounds = std::max<size_t>(1, 10000000 / std::max<size_t>(1, keys.size()));
+    double sum = 0;
+
+    auto map_time = time_per_call(keys, rounds, [&](uint64_t key)
+    {
+        auto iter = weights.find(key);
+        if (iter != weights.cend())
+        {
+            sum += iter->second;
+        }
+    });
+
+    auto flat_time = time_per_call(keys, rounds, [&](uint64_t key)
+    {
+        sum += flat.weight(key);
+    });
+
+    auto concurrent_time = time_per_call(keys, rounds, [&](uint64_t key)
+    {
+        sum += concurrent.get(key);
+    });
+
+    INFO << "lookup: unordered_map = " << map_time << "ns, flat map = " << flat_time
+        << "ns, concurrent map = " << concurrent_time
+        << "ns (" << keys.size() * rounds << " lookups, checksum = " << sum << ")" << std::endl;
+}
+
+/**
+ * 对比 bigram 查找时是否先查布隆过滤器，查询的词对在词典中均匀随机选取，绝大部分不存在.
+ */
+void bench_bigram(const ime::Dictionary &dict, const std::string &model_file)
+{
+    static const std::string prefix = "bigram:";
+
+    std::vector<std::pair<uint64_t, double>> weights;
+    std::ifstream is(model_file);
+    while (!is.eof())
+    {
+        std::string line;
+        std::string feature;
+        double weight;
+
+        std::getline(is, line);
+        std::stringstream ss(line);
+        ss >> feature >> weight;
+        if (feature.compare(0, prefix.length(), prefix) != 0)
+        {
+            continue;
+        }
+
+        for (
+            auto pos = feature.find('_', prefix.length());
+            pos != std::string::npos;
+            pos = feature.find('_', pos + 1)
+        )
+        {
+            auto prev = dict.id(feature.substr(prefix.length(), pos - prefix.length()));
+            auto cur = dict.id(feature.substr(pos + 1));
+            if ((prev != ime::Dictionary::unknown_id) && (cur != ime::Dictionary::unknown_id))
+            {
+                weights.emplace_back(ime::BigramTable::key(prev, cur), weight);
+                break;
+            }
+        }
+    }
+
+    ime::BigramTable table;
+    table.build(weights, dict.word_count());
+    ime::BloomFilter filter;
+    filter.reset(weights.size());
+    for (auto &i : weights)
+    {
+        filter.add(i.first);
+    }
+
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<size_t> dist(0, dict.word_count() - 1);
+    std::vector<uint64_t> keys(1000000);
+    for (auto &key : keys)
+    {
+        key = ime::BigramTable::key(dist(rng), dist(rng));
+    }
+
+    size_t absent = 0;
+    size_t rejected = 0;
+    for (auto key : keys)
+    {
+        if (table.find(ime::BigramTable::prev_id(key), ime::BigramTable::cur_id(key)) == nullptr)
+        {
+            ++absent;
+            if (!filter.may_contain(key))
+            {
+                ++rejected;
+            }
+        }
+    }
+
+    double sum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto key : keys)
+    {
+        sum += table.weight(ime::BigramTable::prev_id(key), ime::BigramTable::cur_id(key));
+    }
+    auto middle = std::chrono::high_resolution_clock::now();
+    for (auto key : keys)
+    {
+        if (filter.may_contain(key))
+        {
+            sum += table.weight(ime::BigramTable::prev_id(key), ime::BigramTable::cur_id(key));
+        }
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    INFO << table.size() << " bigrams, filter = " << filter.memory() << " bytes, "
+        << static_cast<double>(absent) / keys.size() << " of queries absent, "
+        << static_cast<double>(rejected) / absent << " of them rejected by filter" << std::endl;
+    INFO << "bigram lookup: table = "
+        << std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(middle - start).count() / keys.size()
+        << "ns, filter + table = "
+        << std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(stop - middle).count() / keys.size()
+        << "ns (checksum = " << sum << ")" << std::endl;
+}
+
+void bench_decode(ime::Decoder &decoder, const std::string &eval_file, bool frozen)
+{
+    std::vector<std::string> codes;
+    std::ifstream is(eval_file);
+    while (!is.eof())
+    {
+        std::string line;
+        std::string code;
+
+        std::getline(is, line);
+        std::stringstream ss(line);
+        ss >> code;
+        if (!code.empty())
+        {
+            codes.push_back(std::move(code));
+        }
+    }
+
+    if (frozen)
+    {
+        decoder.freeze();
+    }
+    else
+    {
+        decoder.thaw();
+    }
+
+    size_t chars = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto &code : codes)
+    {
+        decoder.predict(code, 1);
+        chars += code.length();
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    auto seconds = std::chrono::duration_cast<std::chrono::duration<double>>(stop - start).count();
+
+    INFO << "decode " << (frozen ? "frozen" : "unfrozen") << " model: "
+        << codes.size() / seconds << " samples/s, "
+        << seconds * 1e9 / chars << "ns/char" << std::endl;
+}
+
+/**
+ * 评估并把包含延迟分布、各线程吞吐率、各阶段耗时和按编码长度分组结果的报告以 JSON 写入 report_file.
+ */
+void bench_report(const ime::Decoder &decoder, const std::string &eval_file, const std::string &report_file)
+{
+    ime::Metrics metrics;
+    ime::EvaluationReport report;
+    std::ifstream is(eval_file);
+    decoder.evaluate(is, 100, metrics, report);
+
+    std::ofstream os(report_file);
+    if (!report.write(os, metrics) || !os.flush())
+    {
+        ERROR << "cannot write report " << report_file << std::endl;
+        return;
+    }
+
+    INFO << "evaluation report of " << report.samples().size() << " samples written to "
+        << report_file << std::endl;
+}
+
+/**
+ * 输出一个阶段平均到每个编码字符的耗时和硬件计数.
+ */
+void output_phase(const std::string &name, double seconds, const ime::PerfValues &values, double chars)
+{
+    std::stringstream ss;
+    ss << std::setw(8) << name << ": " << seconds * 1e9 / chars << "ns/char";
+    if (ime::PerfCounters::enabled())
+    {
+        ss << ", cycles = " << values.cycles / chars
+            << ", instructions = " << values.instructions / chars
+            << ", cache misses = " << values.cache_misses / chars
+            << ", branch misses = " << values.branch_misses / chars;
+    }
+    INFO << ss.str() << std::endl;
+}
+
+/**
+ * 用评估语料逐个样本训练一遍，分阶段统计解码和更新权重的耗时，硬件计数器可用时同时统计计数.
+ *
+ * 会修改 decoder 的模型
+ */
+void bench_update(ime::Decoder &decoder, const std::string &eval_file)
+{
+    ime::Corpus corpus;
+    if (!corpus.open_text(eval_file))
+    {
+        return;
+    }
+
+    std::vector<std::string_view> codes;
+    std::vector<std::string_view> texts;
+    std::vector<double> weights;
+    corpus.read(static_cast<size_t>(0), corpus.size(), codes, texts, weights);
+
+    ime::SearchStats stats(true);
+    double chars = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < codes.size(); ++i)
+    {
+        size_t index;
+        double prob;
+        decoder.update(codes[i], texts[i], weights[i], index, prob, &stats);
+        chars += codes[i].length();
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    INFO << "update " << codes.size() << " samples: " << seconds * 1e9 / chars << "ns/char" << std::endl;
+    auto &phases = stats.phases;
+    auto &counters = stats.counters;
+    output_phase("lookup", phases.lookup, counters.lookup, chars);
+    output_phase("extract", phases.extract, counters.extract, chars);
+    output_phase("score", phases.score, counters.score, chars);
+    output_phase("topk", phases.topk, counters.topk, chars);
+    output_phase("update", phases.update, counters.update, chars);
+}
+
+/**
+ * 输出 metrics 中一种区间的堆分配统计.
+ */
+void output_allocs(const std::string &prefix, const ime::Metrics &metrics, const std::string &name)
+{
+    INFO << prefix << " " << name << ": "
+        << metrics.get("allocations per " + name) << " allocations, "
+        << metrics.get("allocated bytes per " + name) << " bytes, peak live "
+        << metrics.get("peak live bytes per " + name) << " bytes" << std::endl;
+}
+
+/**
+ * 统计评估和批量训练时每次解码、每次提早更新和每一批的堆分配次数、字节数和峰值存活字节数.
+ *
+ * 训练一遍评估语料，会修改 decoder 的模型
+ */
+void bench_allocations(ime::Decoder &decoder, const std::string &eval_file)
+{
+    ime::Corpus corpus;
+    if (!corpus.open_text(eval_file))
+    {
+        return;
+    }
+
+    ime::AllocCounter::start();
+
+    ime::Metrics metrics;
+    decoder.evaluate(corpus, 100, metrics);
+    output_allocs("evaluate", metrics, "decode");
+
+    metrics.clear();
+    std::ifstream is(eval_file);
+    decoder.train(is, 100, metrics);
+    output_allocs("train", metrics, "decode");
+    output_allocs("train", metrics, "early update");
+    output_allocs("train", metrics, "batch");
+
+    ime::AllocCounter::stop();
+}
+
+/**
+ * 在同一进程中依次以各个集束宽度评估，输出精度和延迟的对照表.
+ *
+ * 词典、模型和评估语料只载入一次，各次评估只修改解码器的集束宽度
+ */
+void bench_beam_sweep(ime::Decoder &decoder, const std::string &eval_file, const std::vector<size_t> &beams)
+{
+    ime::Corpus corpus;
+    if (!corpus.open_text(eval_file))
+    {
+        return;
+    }
+
+    std::cout << std::setw(6) << "beam"
+        << std::setw(11) << "precision"
+        << std::setw(11) << "p@beam"
+        << std::setw(9) << "success"
+        << std::setw(9) << "loss"
+        << std::setw(12) << "samples/s"
+        << std::setw(10) << "p50(us)"
+        << std::setw(10) << "p99(us)" << std::endl;
+
+    auto original = decoder.beam();
+    for (auto beam : beams)
+    {
+        decoder.beam(beam);
+
+        ime::Metrics metrics;
+        ime::EvaluationReport report;
+        decoder.evaluate(corpus, 100, metrics, report);
+
+        std::stringstream ss;
+        ss << "p@" << beam;
+        std::cout << std::fixed
+            << std::setw(6) << beam
+            << std::setprecision(4)
+            << std::setw(11) << metrics.get("precision")
+            << std::setw(11) << metrics.get(ss.str())
+            << std::setw(9) << metrics.get("success rate")
+            << std::setw(9) << metrics.get("loss")
+            << std::setprecision(1)
+            << std::setw(12) << report.throughput()
+            << std::setw(10) << report.latency(0.5) * 1e6
+            << std::setw(10) << report.latency(0.99) * 1e6 << std::endl;
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    decoder.beam(original);
+}
+
+/**
+ * 解析逗号分隔的集束宽度列表.
+ */
+bool parse_beams(const std::string &s, std::vector<size_t> &beams)
+{
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        char *end;
+        auto beam = strtoul(item.c_str(), &end, 10);
+        if (item.empty() || (*end != '\0') || (beam == 0))
+        {
+            return false;
+        }
+        beams.push_back(beam);
+    }
+    return !beams.empty();
+}
+
+void usage(const char *prog)
+{
+    ERROR << "usage: " << prog << " [-B BEAMS] [-p] [-a] DICT_FILE MODEL_FILE [EVAL_FILE [REPORT_FILE]]" << std::endl
+        << "  -B BEAMS  only evaluate EVAL_FILE with each of the comma separated beam sizes" << std::endl
+        << "  -p        count cycles, instructions, cache and branch misses per phase with perf_event_open" << std::endl
+        << "  -a        count heap allocations per decode, early update and batch" << std::endl;
+}
+
+/**
+ * 把精确模型按不同槽位数投影到哈希特征空间，对比冲突率和预测准确率.
+ */
+void bench_hashing(
+    const ime::Dictionary &dict,
+    const std::string &model_file,
+    const std::string &eval_file
+)
+{
+    ime::Metrics metrics;
+    ime::Decoder exact(dict);
+    exact.load(model_file);
+    exact.evaluate(eval_file, metrics, 100);
+    INFO << "exact model: precision = " << metrics.get("precision") << std::endl;
+
+    for (size_t bits = 14; bits <= 22; bits += 2)
+    {
+        ime::Decoder decoder(dict);
+        decoder.load(model_file);
+        auto collision_rate = decoder.hash(bits);
+
+        metrics.clear();
+        decoder.evaluate(eval_file, metrics, 100);
+        INFO << "hash bits = " << bits << ": " << (sizeof(double) << bits) << " bytes, collision rate = "
+            << collision_rate << ", precision = " << metrics.get("precision") << std::endl;
+    }
+}
+
+}   // namespace
+
+
+int main(int argc, char **argv)
+{
+    std::vector<size_t> beams;
+    bool counters = false;
+    bool allocations = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "B:pa")) != -1)
+    {
+        switch (opt)
+        {
+        case 'B':
+            if (!parse_beams(optarg, beams))
+            {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'p':
+            counters = true;
+            break;
+        case 'a':
+            allocations = true;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if ((argc - optind < 2) || (!beams.empty() && (argc - optind < 3)))
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // 计数器不可用时只输出耗时
+    if (counters)
+    {
+        ime::PerfCounters::start();
+    }
+
+    std::string dict_file = argv[optind];
+    std::string model_file = argv[optind + 1];
+
+    ime::Dictionary dict(dict_file, 20);
+
+    if (!beams.empty())
+    {
+        ime::Decoder decoder(dict);
+        decoder.load(model_file);
+        bench_beam_sweep(decoder, argv[optind + 2], beams);
+        return 0;
+    }
+
+    bench_weight_map(dict, model_file);
+    bench_bigram(dict, model_file);
+
+    if (argc - optind > 2)
+    {
+        std::string eval_file = argv[optind + 2];
+
+        ime::Decoder decoder(dict);
+        decoder.load(model_file);
+
+        bench_decode(decoder, eval_file, false);
+        bench_decode(decoder, eval_file, true);
+
+        if (argc - optind > 3)
+        {
+            // 报告的指标中同时包含每次解码的分配统计
+            if (allocations)
+            {
+                ime::AllocCounter::start();
+            }
+            bench_report(decoder, eval_file, argv[optind + 3]);
+            ime::AllocCounter::stop();
+        }
+
+        if (allocations)
+        {
+            bench_allocations(decoder, eval_file);
+        }
+
+        bench_update(decoder, eval_file);
+
+        bench_hashing(dict, model_file, eval_file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ *
+ */
+
+#include <malloc.h>
+
+#include "alloc.h"
+
+
+namespace ime
+{
+
+namespace
+{
+
+/**
+ * 一个线程的计数，只由所属线程读写，成员都是平凡类型，访问时不需要初始化检查.
+ */
+struct Counters
+{
+    uint64_t count;
+    uint64_t bytes;
+    int64_t live;
+    int64_t peak;
+};
+
+thread_local Counters local_counters;
+
+std::atomic<uint64_t> global_count(0);
+std::atomic<uint64_t> global_bytes(0);
+std::atomic<int64_t> global_live(0);
+std::atomic<int64_t> global_peak(0);
+
+void raise_peak(std::atomic<int64_t> &peak, int64_t value)
+{
+    auto current = peak.load(std::memory_order_relaxed);
+    while ((value > current) && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed));
+}
+
+}   // namespace
+
+std::atomic<bool> AllocCounter::_enabled(false);
+
+void AllocCounter::allocated(void *p, size_t size)
+{
+    int64_t usable = malloc_usable_size(p);
+    auto &c = local_counters;
+    ++c.count;
+    c.bytes += size;
+    c.live += usable;
+    c.peak = std::max(c.peak, c.live);
+
+    global_count.fetch_add(1, std::memory_order_relaxed);
+    global_bytes.fetch_add(size, std::memory_order_relaxed);
+    raise_peak(global_peak, global_live.fetch_add(usable, std::memory_order_relaxed) + usable);
+}
+
+void AllocCounter::deallocated(void *p)
+{
+    int64_t usable = malloc_usable_size(p);
+    local_counters.live -= usable;
+    global_live.fetch_sub(usable, std::memory_order_relaxed);
+}
+
+void AllocScope::start(bool all_threads_)
+{
+    all_threads = all_threads_;
+    active = AllocCounter::enabled();
+    if (!active)
+    {
+        return;
+    }
+
+    if (all_threads)
+    {
+        count = global_count.load(std::memory_order_relaxed);
+        bytes = global_bytes.load(std::memory_order_relaxed);
+        live = global_live.load(std::memory_order_relaxed);
+        saved_peak = global_peak.exchange(live, std::memory_order_relaxed);
+    }
+    else
+    {
+        auto &c = local_counters;
+        count = c.count;
+        bytes = c.bytes;
+        live = c.live;
+        saved_peak = c.peak;
+        c.peak = c.live;
+    }
+}
+
+void AllocScope::stop(AllocStats &stats)
+{
+    if (!active)
+    {
+        return;
+    }
+    active = false;
+
+    int64_t peak;
+    if (all_threads)
+    {
+        stats.count += global_count.load(std::memory_order_relaxed) - count;
+        stats.bytes += global_bytes.load(std::memory_order_relaxed) - bytes;
+        peak = global_peak.load(std::memory_order_relaxed);
+        raise_peak(global_peak, saved_peak);
+    }
+    else
+    {
+        auto &c = local_counters;
+        stats.count += c.count - count;
+        stats.bytes += c.bytes - bytes;
+        peak = c.peak;
+        c.peak = std::max(c.peak, saved_peak);
+    }
+
+    ++stats.scopes;
+    stats.peak = std::max<uint64_t>(stats.peak, std::max<int64_t>(peak - live, 0));
+}
+
+}   // namespace ime
@@ -0,0 +1,117 @@
+/**
+ * 堆分配统计.
+ */
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+
+
+namespace ime
+{
+
+/**
+ * 若干个统计区间的堆分配次数和字节数.
+ */
+struct AllocStats
+{
+    uint64_t scopes;        ///< 统计的区间个数
+    uint64_t count;         ///< 分配次数
+    uint64_t bytes;         ///< 申请的字节数
+    uint64_t peak;          ///< 区间内存活字节数相对开始时的最大增量，多个区间取最大值
+
+    AllocStats() : scopes(0), count(0), bytes(0), peak(0) {}
+
+    AllocStats & operator += (const AllocStats &other)
+    {
+        scopes += other.scopes;
+        count += other.count;
+        bytes += other.bytes;
+        peak = std::max(peak, other.peak);
+        return *this;
+    }
+};
+
+/**
+ * 统计 operator new 和 operator delete 的开关.
+ *
+ * 只有链接了 alloc_hook.o 的程序（bench）替换了全局的 operator new 和 operator delete，
+ * 其他程序的分配不经过这里，开始统计也不会有计数。替换后没有开始时每次分配只多一次
+ * 原子变量的读取和一次分支；开始后每次分配更新当前线程和全局的计数，全局计数是原子操作，
+ * 多线程训练时有额外的争用，统计出的耗时不能和正常运行比较。
+ * 存活字节数按 malloc_usable_size 计算，开始之前分配、之后释放的内存会使存活字节数偏低
+ */
+class AllocCounter
+{
+public:
+    static void start()
+    {
+        _enabled.store(true, std::memory_order_relaxed);
+    }
+
+    static void stop()
+    {
+        _enabled.store(false, std::memory_order_relaxed);
+    }
+
+    static bool enabled()
+    {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * 记录一次分配，由替换的 operator new 在开始统计后调用，size 为申请的字节数.
+     */
+    static void allocated(void *p, size_t size);
+
+    /**
+     * 记录一次释放，由替换的 operator delete 在开始统计后调用.
+     */
+    static void deallocated(void *p);
+
+private:
+    static std::atomic<bool> _enabled;
+};
+
+/**
+ * 一个统计区间，start 时记录开始时的计数，stop 时把差值累加到 AllocStats.
+ *
+ * 默认只统计当前线程的分配，区间可以嵌套；all_threads 为 true 时统计全部线程，
+ * 用于包含并行计算的区间，这时的峰值是全部线程合计的存活字节数，同一时刻只应有一个这样的区间。
+ * 构造时不读取任何计数，只在需要统计时调用 start
+ */
+class AllocScope
+{
+public:
+    AllocScope() : all_threads(false), active(false), count(0), bytes(0), live(0), saved_peak(0) {}
+
+    AllocScope(const AllocScope &) = delete;
+
+    AllocScope & operator = (const AllocScope &) = delete;
+
+    /**
+     * 开始统计，AllocCounter 没有开始时什么也不做.
+     */
+    void start(bool all_threads_ = false);
+
+    /**
+     * 结束统计，只有第一次调用有效，没有开始统计则什么也不做.
+     */
+    void stop(AllocStats &stats);
+
+private:
+    bool all_threads;
+    bool active;
+    uint64_t count;
+    uint64_t bytes;
+    int64_t live;
+    int64_t saved_peak;     ///< 外层区间的峰值，结束时恢复
+};
+
+}   // namespace ime
+
+#endif  // _ALLOC_H_
@@ -0,0 +1,114 @@
+/**
+ * 替换全局的 operator new 和 operator delete，开始统计后把分配交给 AllocCounter 计数.
+ *
+ * 只链接到 bench，train 和 test 使用标准库的分配函数。对齐分配的版本没有替换，不计入统计
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include "alloc.h"
+
+
+namespace
+{
+
+void * allocate(size_t size)
+{
+    if (size == 0)
+    {
+        size = 1;
+    }
+
+    void *p;
+    while ((p = std::malloc(size)) == nullptr)
+    {
+        auto handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+
+    if (ime::AllocCounter::enabled())
+    {
+        ime::AllocCounter::allocated(p, size);
+    }
+    return p;
+}
+
+void deallocate(void *p)
+{
+    if ((p != nullptr) && ime::AllocCounter::enabled())
+    {
+        ime::AllocCounter::deallocated(p);
+    }
+    std::free(p);
+}
+
+}   // namespace
+
+void * operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void * operator new[](std::size_t size)
+{
+    return allocate(size);
+}
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return allocate(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void * operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return allocate(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void operator delete(void *p) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    deallocate(p);
+}
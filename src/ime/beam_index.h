@@ -0,0 +1,85 @@
+/**
+ * 集束节点按前驱的索引.
+ */
+
+#ifndef _BEAM_INDEX_H_
+#define _BEAM_INDEX_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <limits>
+
+#include "common.h"
+
+
+namespace ime
+{
+
+/**
+ * 从 (前驱节点在上一个集束中的下标, 词) 到节点在集束中下标的索引.
+ *
+ * 训练时在集束中跟踪目标路径，查找时只比较同一个前驱的子节点（通常只有几个），
+ * 不用遍历整个集束。建立索引只需遍历一遍集束，把节点按前驱下标串成链表，
+ * 不需要计算哈希；同一前驱的节点按下标从小到大排列，查找结果和顺序查找一致。
+ * 由 advance 和 end_decode 在剪枝后随集束一起建立，只有训练时传入索引，预测不承担这部分开销。
+ * 数组在多次 build 之间复用，不重复分配
+ */
+class BeamIndex
+{
+public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    BeamIndex() : heads(), next(), beam(nullptr) {}
+
+    /**
+     * 为 beam 建立索引，prev_beam 为上一个集束.
+     */
+    void build(const std::vector<Node> &beam_, const std::vector<Node> &prev_beam)
+    {
+        beam = &beam_;
+        heads.assign(prev_beam.size(), empty);
+        next.resize(beam_.size());
+
+        // 从后向前插入链表头，链表中的下标从小到大
+        for (auto j = beam_.size(); j-- > 0; )
+        {
+            auto prev = static_cast<size_t>(beam_[j].prev - prev_beam.data());
+            assert(prev < prev_beam.size());
+
+            next[j] = heads[prev];
+            heads[prev] = static_cast<uint32_t>(j);
+        }
+    }
+
+    /**
+     * 查找前驱下标为 prev、词为 word 的节点的下标，不存在时返回 npos.
+     */
+    size_t find(size_t prev, const Word *word) const
+    {
+        assert(beam != nullptr);
+        assert(prev < heads.size());
+
+        for (auto j = heads[prev]; j != empty; j = next[j])
+        {
+            if ((*beam)[j].word == word)
+            {
+                return j;
+            }
+        }
+
+        return npos;
+    }
+
+private:
+    static constexpr uint32_t empty = std::numeric_limits<uint32_t>::max();
+
+    std::vector<uint32_t> heads;        ///< 以前驱下标为下标，该前驱的第一个子节点
+    std::vector<uint32_t> next;         ///< 以节点下标为下标，同一前驱的下一个子节点
+    const std::vector<Node> *beam;
+};
+
+}   // namespace ime
+
+#endif  // _BEAM_INDEX_H_
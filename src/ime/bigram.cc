@@ -0,0 +1,48 @@
+/**
+ *
+ */
+
+#include <cassert>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "bigram.h"
+
+
+namespace ime
+{
+
+void BigramTable::build(
+    std::vector<std::pair<uint64_t, double>> weights,
+    size_t word_count
+)
+{
+    std::sort(
+        weights.begin(),
+        weights.end(),
+        [](const std::pair<uint64_t, double> &a, const std::pair<uint64_t, double> &b)
+        {
+            return a.first < b.first;
+        }
+    );
+
+    offsets.assign(word_count + 1, 0);
+    successors.clear();
+    successors.reserve(weights.size());
+
+    // 先统计每个前词的后继个数，再求前缀和得到偏移
+    for (auto &i : weights)
+    {
+        assert(prev_id(i.first) < word_count);
+        ++offsets[prev_id(i.first) + 1];
+        successors.push_back({static_cast<uint32_t>(cur_id(i.first)), i.second});
+    }
+
+    for (size_t i = 1; i < offsets.size(); ++i)
+    {
+        offsets[i] += offsets[i - 1];
+    }
+}
+
+}   // namespace ime
@@ -0,0 +1,140 @@
+/**
+ * bigram 特征权重的紧凑存储.
+ */
+
+#ifndef _BIGRAM_H_
+#define _BIGRAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+
+namespace ime
+{
+
+/**
+ * 按前一个词编号索引的 bigram 权重表.
+ *
+ * 所有 bigram 按（前词，后词）排序后存放在一个连续数组中，
+ * offsets[prev] 到 offsets[prev + 1] 为前词 prev 的全部后继，按后词编号有序。
+ * 查找只需在一小段连续内存中搜索，不需要哈希。
+ * 构造后只读，训练过程中的更新在 Model 的哈希表中进行，冻结时再转换为本结构
+ */
+class BigramTable
+{
+public:
+    struct Successor
+    {
+        uint32_t id;
+        double weight;
+    };
+
+    BigramTable() : offsets(), successors() {}
+
+    /**
+     * 从以 key(prev, cur) 为键的权重列表构造，word_count 为词编号的上界.
+     */
+    void build(std::vector<std::pair<uint64_t, double>> weights, size_t word_count);
+
+    void clear()
+    {
+        offsets.clear();
+        successors.clear();
+    }
+
+    size_t size() const
+    {
+        return successors.size();
+    }
+
+    bool empty() const
+    {
+        return successors.empty();
+    }
+
+    /**
+     * 查找 bigram (prev, cur) 的权重，不存在返回 nullptr.
+     */
+    const double * find(size_t prev, size_t cur) const
+    {
+        if (prev + 1 >= offsets.size())
+        {
+            return nullptr;
+        }
+
+        auto begin = successors.data() + offsets[prev];
+        auto end = successors.data() + offsets[prev + 1];
+
+        // 后继较多时先二分缩小范围，剩下的几个顺序查找
+        while (end - begin > linear_search_limit)
+        {
+            auto mid = begin + (end - begin) / 2;
+            if (mid->id < cur)
+            {
+                begin = mid + 1;
+            }
+            else
+            {
+                end = mid + 1;
+            }
+        }
+
+        for (auto p = begin; (p != end) && (p->id <= cur); ++p)
+        {
+            if (p->id == cur)
+            {
+                return &p->weight;
+            }
+        }
+
+        return nullptr;
+    }
+
+    double weight(size_t prev, size_t cur) const
+    {
+        auto p = find(prev, cur);
+        return (p != nullptr) ? *p : 0;
+    }
+
+    /**
+     * 按 (prev, cur) 顺序遍历全部 bigram.
+     */
+    template<typename Function>
+    void for_each(Function f) const
+    {
+        for (size_t prev = 0; prev + 1 < offsets.size(); ++prev)
+        {
+            for (auto i = offsets[prev]; i < offsets[prev + 1]; ++i)
+            {
+                f(prev, successors[i].id, successors[i].weight);
+            }
+        }
+    }
+
+    static uint64_t key(size_t prev, size_t cur)
+    {
+        return (static_cast<uint64_t>(prev) << 32) | static_cast<uint32_t>(cur);
+    }
+
+    static size_t prev_id(uint64_t key)
+    {
+        return static_cast<size_t>(key >> 32);
+    }
+
+    static size_t cur_id(uint64_t key)
+    {
+        return static_cast<size_t>(key & 0xffffffff);
+    }
+
+private:
+    static constexpr std::ptrdiff_t linear_search_limit = 8;
+
+    std::vector<uint32_t> offsets;
+    std::vector<Successor> successors;
+};
+
+}   // namespace ime
+
+#endif  // _BIGRAM_H_
@@ -0,0 +1,196 @@
+/**
+ *
+ */
+
+#include <cstdio>
+#include <string>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "log.h"
+
+
+namespace ime
+{
+
+void Checkpointer::save(std::unique_ptr<Model> snapshot, const TrainState &state)
+{
+    wait();
+
+    writer = std::thread([this, state](std::unique_ptr<Model> model)
+    {
+        auto start = std::chrono::steady_clock::now();
+        // 快照在后台线程冻结，训练线程只负责读出权重
+        model->freeze();
+        if (write(*model, state))
+        {
+            auto stop = std::chrono::steady_clock::now();
+            INFO << "checkpoint epoch " << state.epoch + 1 << " batch " << state.batch << " saved "
+                << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
+                << "s" << std::endl;
+        }
+    }, std::move(snapshot));
+}
+
+bool Checkpointer::write(const Model &model, const TrainState &state)
+{
+    std::stringstream ss;
+    ss << prefix << '.' << state.epoch << '.' << state.batch;
+    auto new_model_file = ss.str() + ".model";
+    auto new_counts_file = ss.str() + ".counts";
+
+    std::ofstream model_os(new_model_file);
+    std::ofstream counts_os(new_counts_file, std::ios::binary);
+    if (!model_os || !counts_os)
+    {
+        ERROR << "cannot open checkpoint " << ss.str() << std::endl;
+        return false;
+    }
+
+    // 按完整精度保存权重，恢复后和不中断的训练结果一致
+    model_os.precision(std::numeric_limits<double>::max_digits10);
+    if (!model.save(model_os) || !model.save_counts(counts_os) || !model_os.flush() || !counts_os.flush())
+    {
+        ERROR << "failed to write checkpoint " << ss.str() << std::endl;
+        return false;
+    }
+    model_os.close();
+    counts_os.close();
+
+    auto tmp_file = prefix + ".tmp";
+    std::ofstream os(tmp_file);
+    os << "seed\t" << state.seed << std::endl
+        << "shuffle\t" << state.shuffle << std::endl
+        << "batch_size\t" << state.batch_size << std::endl
+        << "bucket_width\t" << state.bucket_width << std::endl
+        << "token_budget\t" << state.token_budget << std::endl
+        << "epoch\t" << state.epoch << std::endl
+        << "batch\t" << state.batch << std::endl
+        << "model\t" << new_model_file << std::endl
+        << "counts\t" << new_counts_file << std::endl;
+    os.close();
+
+    if (!os || (std::rename(tmp_file.c_str(), prefix.c_str()) != 0))
+    {
+        ERROR << "failed to write checkpoint " << prefix << std::endl;
+        return false;
+    }
+
+    // 新的检查点已经生效，删除上一个检查点的文件
+    if (!model_file.empty() && (model_file != new_model_file))
+    {
+        std::remove(model_file.c_str());
+        std::remove(counts_file.c_str());
+    }
+    model_file = new_model_file;
+    counts_file = new_counts_file;
+    return true;
+}
+
+bool Checkpointer::exists() const
+{
+    struct stat st;
+    return stat(prefix.c_str(), &st) == 0;
+}
+
+bool Checkpointer::load(Model &model, TrainState &state)
+{
+    std::ifstream is(prefix);
+    if (!is)
+    {
+        ERROR << "cannot open checkpoint " << prefix << std::endl;
+        return false;
+    }
+
+    std::string new_model_file;
+    std::string new_counts_file;
+    size_t fields = 0;
+    while (!is.eof())
+    {
+        std::string line;
+        std::string key;
+
+        std::getline(is, line);
+        std::stringstream ss(line);
+        ss >> key;
+        if (key.empty())
+        {
+            continue;
+        }
+
+        ++fields;
+        if (key == "seed")
+        {
+            ss >> state.seed;
+        }
+        else if (key == "shuffle")
+        {
+            ss >> state.shuffle;
+        }
+        else if (key == "batch_size")
+        {
+            ss >> state.batch_size;
+        }
+        else if (key == "bucket_width")
+        {
+            ss >> state.bucket_width;
+        }
+        else if (key == "token_budget")
+        {
+            ss >> state.token_budget;
+        }
+        else if (key == "epoch")
+        {
+            ss >> state.epoch;
+        }
+        else if (key == "batch")
+        {
+            ss >> state.batch;
+        }
+        else if (key == "model")
+        {
+            ss >> new_model_file;
+        }
+        else if (key == "counts")
+        {
+            ss >> new_counts_file;
+        }
+        else
+        {
+            WARN << "unknown checkpoint field " << key << std::endl;
+            --fields;
+        }
+    }
+
+    if ((fields != 9) || new_model_file.empty() || new_counts_file.empty())
+    {
+        ERROR << "invalid checkpoint " << prefix << std::endl;
+        return false;
+    }
+
+    std::ifstream model_is(new_model_file);
+    std::ifstream counts_is(new_counts_file, std::ios::binary);
+    if (!model_is || !counts_is || !model.load(model_is) || !model.load_counts(counts_is))
+    {
+        ERROR << "cannot load checkpoint " << prefix << std::endl;
+        return false;
+    }
+
+    model_file = new_model_file;
+    counts_file = new_counts_file;
+
+    INFO << "resume from checkpoint " << prefix
+        << ", epoch " << state.epoch + 1 << " batch " << state.batch << std::endl;
+    return true;
+}
+
+}   // namespace ime
@@ -0,0 +1,97 @@
+/**
+ * 训练检查点.
+ */
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <thread>
+
+#include "model.h"
+
+
+namespace ime
+{
+
+/**
+ * 训练进度，连同模型权重保存在检查点中.
+ *
+ * 样本顺序和批次由种子和批次设置确定（见 EpochScheduler），
+ * 恢复时重新生成第 epoch 轮的顺序并跳过已完成的 batch 批，不需要重放数据
+ */
+struct TrainState
+{
+    uint64_t seed;
+    bool shuffle;
+    size_t batch_size;
+    size_t bucket_width;
+    size_t token_budget;
+    size_t epoch;           ///< 当前轮次，从 0 开始
+    size_t batch;           ///< 当前轮次已完成的批次数
+};
+
+/**
+ * 在后台线程写检查点.
+ *
+ * 检查点由三个文件组成：以 prefix 为名的进度文件，以及进度文件中记录的模型文件和特征准入计数文件。
+ * 模型和计数先写入以轮次和批次命名的新文件，再写临时进度文件并改名为 prefix，
+ * 改名之后才删除上一个检查点的文件，写到一半时中断不会破坏已有的检查点
+ */
+class Checkpointer
+{
+public:
+    explicit Checkpointer(const std::string &prefix_) : prefix(prefix_), model_file(), counts_file(), writer() {}
+
+    Checkpointer(const Checkpointer &) = delete;
+
+    Checkpointer & operator = (const Checkpointer &) = delete;
+
+    ~Checkpointer()
+    {
+        wait();
+    }
+
+    /**
+     * 在后台线程保存模型快照和训练进度，上一次保存尚未完成时先等待.
+     *
+     * snapshot 通常是训练线程在两批之间复制的模型（见 Model::snapshot），在后台线程冻结后保存，保存期间训练可以继续
+     */
+    void save(std::unique_ptr<Model> snapshot, const TrainState &state);
+
+    /**
+     * 等待正在进行的保存完成.
+     */
+    void wait()
+    {
+        if (writer.joinable())
+        {
+            writer.join();
+        }
+    }
+
+    /**
+     * 是否已经保存过检查点.
+     */
+    bool exists() const;
+
+    /**
+     * 从最近的检查点载入模型和训练进度，检查点不存在或损坏时返回 false.
+     */
+    bool load(Model &model, TrainState &state);
+
+private:
+    bool write(const Model &model, const TrainState &state);
+
+    std::string prefix;
+    std::string model_file;         ///< 当前检查点的模型文件
+    std::string counts_file;        ///< 当前检查点的特征准入计数文件
+    std::thread writer;
+};
+
+}   // namespace ime
+
+#endif  // _CHECKPOINT_H_
@@ -7,6 +7,7 @@
 
 #include <cmath>
 #include <cassert>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <utility>
@@ -17,6 +18,19 @@
 namespace ime
 {
 
+/**
+ * 64 位整数的混合函数（MurmurHash3 的 fmix64），输入的每一位都影响输出的全部位.
+ */
+inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
 /**
  * 代表词典中一个词的信息.
  */
@@ -24,9 +38,14 @@ struct Word
 {
     std::string code;
     std::string text;
-
-    Word(const std::string &code_ = "", const std::string &text_ = "") :
-        code(code_), text(text_) {}
+    /// 词文本的编号，同一文本的不同编码共享编号，0 保留给句子起始和结束标识
+    size_t id;
+
+    Word(
+        const std::string &code_ = "",
+        const std::string &text_ = "",
+        size_t id_ = 0
+    ) : code(code_), text(text_), id(id_) {}
 };
 
 inline std::ostream & operator << (std::ostream &os, const Word &word)
@@ -46,10 +65,8 @@ struct Node
     const Word *word;
     /// 指向路径中前一个有词的节点，用于构造 n-gram 特征
     const Node *prev_word;
-    /// 局部特征，对经过节点的所有路径都生效的特征保存在这里
-    std::vector<std::pair<std::string, double>> local_features;
-    /// 全局特征，描述整条路径的特征，只有当节点是路径的最后一个节点才生效
-    std::vector<std::pair<std::string, double>> global_features;
+    /// 节点所在集束已读入的编码长度，特征模板由此得到未匹配的编码
+    size_t pos;
     /// 为加速计算，保存该节点及之前子路径局部特征的得分
     double local_score;
     /// 以该节点为代表的路径（即以该节点结尾的路径）的得分
@@ -61,19 +78,17 @@ struct Node
         text_pos(0),
         word(nullptr),
         prev_word(nullptr),
-        local_features(),
-        global_features(),
+        pos(0),
         local_score(0),
         score(0) {}
 
-    Node(const Node *prev_) :
+    Node(const Node *prev_, size_t pos_) :
         prev(prev_),
         code_pos(prev_->code_pos),
         text_pos(prev_->text_pos),
         word(nullptr),
         prev_word((prev_->word != nullptr) ? prev_ : prev_->prev_word),
-        local_features(),
-        global_features(),
+        pos(pos_),
         local_score(0),
         score(0)
     {
@@ -91,8 +106,7 @@ struct Node
         text_pos(text_pos_),
         word(word_),
         prev_word((prev_->word != nullptr) ? prev_ : prev_->prev_word),
-        local_features(),
-        global_features(),
+        pos(code_pos_),
         local_score(0),
         score(0)
     {
@@ -105,8 +119,7 @@ struct Node
         text_pos(other.text_pos),
         word(other.word),
         prev_word(other.prev_word),
-        local_features(other.local_features),
-        global_features(other.global_features),
+        pos(other.pos),
         local_score(other.local_score),
         score(other.score) {}
 
@@ -116,8 +129,7 @@ struct Node
         text_pos(other.text_pos),
         word(other.word),
         prev_word(other.prev_word),
-        local_features(std::move(other.local_features)),
-        global_features(std::move(other.global_features)),
+        pos(other.pos),
         local_score(other.local_score),
         score(other.score) {}
 
@@ -133,8 +145,7 @@ inline void swap(Node &a, Node &b)
     std::swap(a.code_pos, b.code_pos);
     std::swap(a.text_pos, b.text_pos);
     std::swap(a.word, b.word);
-    std::swap(a.local_features, b.local_features);
-    std::swap(a.global_features, b.global_features);
+    std::swap(a.pos, b.pos);
     std::swap(a.local_score, b.local_score);
     std::swap(a.score, b.score);
 }
@@ -146,12 +157,7 @@ inline std::ostream & operator << (std::ostream &os, const Node &node)
         os << *node.word;
     }
 
-    os << '(';
-    for (auto &f : node.local_features)
-    {
-        os << f.first << ':' << f.second << ',';
-    }
-    os << ' ' << node.local_score << ')';
+    os << '(' << node.pos << ' ' << node.local_score << ')';
 
     return os;
 }
@@ -0,0 +1,534 @@
+/**
+ * 支持并发更新的权重哈希表.
+ */
+
+#ifndef _CONCURRENT_MAP_H_
+#define _CONCURRENT_MAP_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <functional>
+
+#include "common.h"
+
+
+namespace ime
+{
+
+/**
+ * 原子地把 delta 加到 value 上.
+ */
+inline void atomic_add(std::atomic<double> &value, double delta)
+{
+    auto old = value.load(std::memory_order_relaxed);
+    while (!value.compare_exchange_weak(old, old + delta, std::memory_order_relaxed));
+}
+
+/**
+ * 训练用的并发开放寻址权重表.
+ *
+ * 槽位保存指向条目的指针，条目包含键、哈希值和原子的权重值。
+ * 查找不加锁，插入新键用 CAS 占据空槽，权重更新用原子加。
+ *
+ * 扩容时不停止其他线程：新建一张两倍大的表挂在旧表之后，
+ * 此后每次插入和查找顺带把旧表的一段槽位迁移到新表。迁移一个槽位时，
+ * 空槽被标记为 sealed，有条目的槽位被打上 moved 标记后再把条目指针复制到新表。
+ * 条目本身不复制，新旧表共享同一个原子值，迁移过程中的更新不会丢失。
+ * 查找从最老的表开始，遇到 sealed 槽位才继续查找下一张表，
+ * 因此同一个键在所有表中只对应一个条目。
+ * 旧表在迁移完成后不再被访问，但并发读可能仍持有它的指针，由 reclaim 在没有并发操作时释放。
+ *
+ * size、for_each、clear、reserve、reclaim 和复制只能在没有并发操作时调用
+ */
+template<typename Key, typename Hash = std::hash<Key>>
+class ConcurrentWeightMap
+{
+public:
+    explicit ConcurrentWeightMap(size_t capacity = initial_capacity) :
+        first(nullptr),
+        head(nullptr),
+        _size(0)
+    {
+        init(capacity);
+    }
+
+    ConcurrentWeightMap(const ConcurrentWeightMap &other) :
+        first(nullptr),
+        head(nullptr),
+        _size(0)
+    {
+        init(other.size() * 2);
+        other.for_each([this](const Key &key, double value) { emplace(key, value); });
+    }
+
+    /**
+     * 接管 other 的全部表和条目，不复制；other 之后只能析构或被赋值.
+     */
+    ConcurrentWeightMap(ConcurrentWeightMap &&other) :
+        first(other.first),
+        head(other.head.load()),
+        _size(other.size())
+    {
+        other.first = nullptr;
+        other.head.store(nullptr);
+        other._size.store(0);
+    }
+
+    ConcurrentWeightMap & operator = (const ConcurrentWeightMap &other)
+    {
+        if (this != &other)
+        {
+            destroy();
+            init(other.size() * 2);
+            other.for_each([this](const Key &key, double value) { emplace(key, value); });
+        }
+        return *this;
+    }
+
+    ~ConcurrentWeightMap()
+    {
+        destroy();
+    }
+
+    size_t size() const
+    {
+        return _size.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    void clear()
+    {
+        destroy();
+        init(initial_capacity);
+    }
+
+    /**
+     * 为至少 n 个键预留空间，只对空表有效.
+     */
+    void reserve(size_t n)
+    {
+        if (empty() && (n * 2 > head.load()->capacity()))
+        {
+            destroy();
+            init(n * 2);
+        }
+    }
+
+    /**
+     * 完成进行中的迁移并释放已迁移完的旧表.
+     */
+    void reclaim()
+    {
+        for (auto t = head.load(); t->next.load() != nullptr; t = head.load())
+        {
+            // 没有并发操作时每段槽位都由这里迁移完，最后一段完成时 head 前进到新表
+            assert(t->cursor.load() < t->capacity());
+            help_migrate(t, t->next.load());
+        }
+
+        while (first != head.load())
+        {
+            auto next = first->next.load();
+            delete first;
+            first = next;
+        }
+    }
+
+    /**
+     * 查找键的权重，键不存在时返回 0.
+     */
+    double get(const Key &key) const
+    {
+        auto entry = find(key, hash(key));
+        return (entry != nullptr) ? entry->value.load(std::memory_order_relaxed) : 0;
+    }
+
+    bool contains(const Key &key) const
+    {
+        return find(key, hash(key)) != nullptr;
+    }
+
+    /**
+     * 键不存在时插入，已存在时不改变原来的值.
+     */
+    void emplace(const Key &key, double value)
+    {
+        insert(key, hash(key), value);
+    }
+
+    /**
+     * 设置键的权重，键不存在时先插入.
+     */
+    void set(const Key &key, double value)
+    {
+        insert(key, hash(key), value)->value.store(value, std::memory_order_relaxed);
+    }
+
+    /**
+     * 把 delta 原子地加到键的权重上，键不存在时先插入.
+     */
+    void add(const Key &key, double delta)
+    {
+        atomic_add(insert(key, hash(key), 0)->value, delta);
+    }
+
+    template<typename Function>
+    void for_each(Function f) const
+    {
+        for (auto t = first; t != nullptr; t = t->next.load())
+        {
+            for (size_t i = 0; i < t->capacity(); ++i)
+            {
+                auto s = t->slots[i].load(std::memory_order_relaxed);
+                // 打了 moved 标记的条目在后面的表中还会遇到
+                if ((s != empty_slot) && (s != sealed_slot) && !(s & moved_bit))
+                {
+                    auto entry = reinterpret_cast<const Entry *>(s);
+                    f(entry->key, entry->value.load(std::memory_order_relaxed));
+                }
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        size_t hash;
+        Key key;
+        std::atomic<double> value;
+
+        Entry(size_t hash_, const Key &key_, double value_) :
+            hash(hash_), key(key_), value(value_) {}
+    };
+
+    struct Table
+    {
+        explicit Table(size_t capacity_) :
+            mask(capacity_ - 1),
+            slots(new std::atomic<uintptr_t>[capacity_]),
+            count(0),
+            next(nullptr),
+            cursor(0),
+            migrated(0)
+        {
+            assert((capacity_ & mask) == 0);
+            for (size_t i = 0; i < capacity_; ++i)
+            {
+                slots[i].store(empty_slot, std::memory_order_relaxed);
+            }
+        }
+
+        size_t capacity() const
+        {
+            return mask + 1;
+        }
+
+        const size_t mask;
+        std::unique_ptr<std::atomic<uintptr_t>[]> slots;
+        std::atomic<size_t> count;          ///< 本表占用的槽位数
+        std::atomic<Table *> next;          ///< 扩容后的新表
+        std::atomic<size_t> cursor;         ///< 下一段待迁移槽位的起点
+        std::atomic<size_t> migrated;       ///< 已迁移完成的槽位数
+    };
+
+    static constexpr size_t initial_capacity = 1024;
+    static constexpr size_t migrate_chunk = 256;
+    static constexpr uintptr_t empty_slot = 0;
+    static constexpr uintptr_t sealed_slot = 1;
+    static constexpr uintptr_t moved_bit = 1;
+
+    /**
+     * 在用户提供的哈希函数之上再混合一次，避免整数键直接取低位造成聚集.
+     */
+    static size_t hash(const Key &key)
+    {
+        return static_cast<size_t>(mix64(Hash()(key)));
+    }
+
+    static Entry * entry_of(uintptr_t s)
+    {
+        return reinterpret_cast<Entry *>(s & ~moved_bit);
+    }
+
+    void init(size_t capacity)
+    {
+        size_t c = initial_capacity;
+        while (c < capacity)
+        {
+            c *= 2;
+        }
+
+        first = new Table(c);
+        head.store(first);
+        _size.store(0);
+    }
+
+    void destroy()
+    {
+        for (auto t = first; t != nullptr; )
+        {
+            for (size_t i = 0; i < t->capacity(); ++i)
+            {
+                auto s = t->slots[i].load(std::memory_order_relaxed);
+                if ((s != empty_slot) && (s != sealed_slot) && !(s & moved_bit))
+                {
+                    delete entry_of(s);
+                }
+            }
+
+            auto next = t->next.load();
+            delete t;
+            t = next;
+        }
+
+        first = nullptr;
+        head.store(nullptr);
+    }
+
+    const Entry * find(const Key &key, size_t h) const
+    {
+        // 查找也协助迁移，只读不写的阶段旧表同样会迁移完，可以尽早由 reclaim 释放
+        auto old = head.load(std::memory_order_acquire);
+        auto next = old->next.load(std::memory_order_acquire);
+        if (next != nullptr)
+        {
+            help_migrate(old, next);
+        }
+
+        for (auto t = head.load(std::memory_order_acquire); t != nullptr; )
+        {
+            auto i = h & t->mask;
+            size_t probe = 0;
+            for (; probe < t->capacity(); ++probe, i = (i + 1) & t->mask)
+            {
+                auto s = t->slots[i].load(std::memory_order_acquire);
+                if (s == empty_slot)
+                {
+                    // 键只会插入探测路径上的第一个空槽，遇到空槽说明键不存在
+                    return nullptr;
+                }
+                else if (s == sealed_slot)
+                {
+                    break;
+                }
+
+                auto entry = entry_of(s);
+                if ((entry->hash == h) && (entry->key == key))
+                {
+                    return entry;
+                }
+            }
+
+            t = t->next.load(std::memory_order_acquire);
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * 查找键对应的条目，不存在时以初始值 value 插入.
+     */
+    Entry * insert(const Key &key, size_t h, double value)
+    {
+        Entry *fresh = nullptr;
+
+        for (auto t = head.load(std::memory_order_acquire); ; )
+        {
+            auto next = t->next.load(std::memory_order_acquire);
+            if (next != nullptr)
+            {
+                help_migrate(t, next);
+            }
+
+            auto i = h & t->mask;
+            for (size_t probe = 0; probe < t->capacity(); )
+            {
+                auto s = t->slots[i].load(std::memory_order_acquire);
+                if (s == empty_slot)
+                {
+                    next = t->next.load(std::memory_order_acquire);
+                    if ((next == nullptr)
+                        && ((t->count.load(std::memory_order_relaxed) + 1) * 2 > t->capacity()))
+                    {
+                        next = grow(t);
+                    }
+
+                    if (next != nullptr)
+                    {
+                        // 表正在迁移，不再接受新键，封闭空槽后到新表插入
+                        t->slots[i].compare_exchange_strong(s, sealed_slot);
+                        continue;
+                    }
+
+                    if (fresh == nullptr)
+                    {
+                        fresh = new Entry(h, key, value);
+                    }
+
+                    if (t->slots[i].compare_exchange_strong(
+                        s,
+                        reinterpret_cast<uintptr_t>(fresh),
+                        std::memory_order_acq_rel
+                    ))
+                    {
+                        t->count.fetch_add(1, std::memory_order_relaxed);
+                        _size.fetch_add(1, std::memory_order_relaxed);
+                        return fresh;
+                    }
+
+                    // 其他线程抢先占据了这个槽位，重新检查
+                    continue;
+                }
+                else if (s == sealed_slot)
+                {
+                    break;
+                }
+
+                auto entry = entry_of(s);
+                if ((entry->hash == h) && (entry->key == key))
+                {
+                    delete fresh;
+                    return entry;
+                }
+
+                ++probe;
+                i = (i + 1) & t->mask;
+            }
+
+            t = t->next.load(std::memory_order_acquire);
+            assert(t != nullptr);
+        }
+    }
+
+    /**
+     * 把迁移中的条目复制到表 t，条目的键不可能已经在 t 中.
+     */
+    void transfer(Table *t, Entry *entry) const
+    {
+        for (; ; t = t->next.load(std::memory_order_acquire))
+        {
+            assert(t != nullptr);
+
+            auto i = entry->hash & t->mask;
+            for (size_t probe = 0; probe < t->capacity(); )
+            {
+                auto s = t->slots[i].load(std::memory_order_acquire);
+                if (s == empty_slot)
+                {
+                    if (t->slots[i].compare_exchange_strong(
+                        s,
+                        reinterpret_cast<uintptr_t>(entry),
+                        std::memory_order_acq_rel
+                    ))
+                    {
+                        t->count.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    continue;
+                }
+                else if (s == sealed_slot)
+                {
+                    break;
+                }
+
+                ++probe;
+                i = (i + 1) & t->mask;
+            }
+        }
+    }
+
+    Table * grow(Table *t)
+    {
+        auto table = new Table(t->capacity() * 2);
+        Table *expected = nullptr;
+        if (t->next.compare_exchange_strong(expected, table, std::memory_order_acq_rel))
+        {
+            return table;
+        }
+        else
+        {
+            delete table;
+            return expected;
+        }
+    }
+
+    /**
+     * 迁移表 t 的一段槽位到 next，每次操作只做一小段，分摊扩容的开销.
+     */
+    void help_migrate(Table *t, Table *next) const
+    {
+        auto begin = t->cursor.fetch_add(migrate_chunk, std::memory_order_relaxed);
+        if (begin >= t->capacity())
+        {
+            return;
+        }
+
+        auto end = std::min(begin + migrate_chunk, t->capacity());
+        for (auto i = begin; i < end; ++i)
+        {
+            auto s = t->slots[i].load(std::memory_order_acquire);
+            while (true)
+            {
+                if (s == empty_slot)
+                {
+                    if (t->slots[i].compare_exchange_weak(s, sealed_slot, std::memory_order_acq_rel))
+                    {
+                        break;
+                    }
+                }
+                else if (s == sealed_slot)
+                {
+                    break;
+                }
+                else
+                {
+                    // 槽位由本线程独占迁移，条目不会已经打上 moved 标记
+                    assert(!(s & moved_bit));
+                    t->slots[i].fetch_or(moved_bit, std::memory_order_acq_rel);
+                    transfer(next, entry_of(s));
+                    break;
+                }
+            }
+        }
+
+        if (t->migrated.fetch_add(end - begin, std::memory_order_acq_rel) + (end - begin)
+            == t->capacity())
+        {
+            advance_head();
+        }
+    }
+
+    /**
+     * 跳过所有已迁移完成的表.
+     */
+    void advance_head() const
+    {
+        auto t = head.load(std::memory_order_acquire);
+        while (t->migrated.load(std::memory_order_acquire) == t->capacity())
+        {
+            auto next = t->next.load(std::memory_order_acquire);
+            if (!head.compare_exchange_strong(t, next, std::memory_order_acq_rel))
+            {
+                // 其他线程已经推进，从新的 head 继续检查
+                continue;
+            }
+            t = next;
+        }
+    }
+
+    Table *first;                   ///< 最早的表，用于释放全部表
+    mutable std::atomic<Table *> head;      ///< 仍在使用的最老的表，查找协助迁移时也会推进
+    std::atomic<size_t> _size;
+};
+
+}   // namespace ime
+
+#endif  // _CONCURRENT_MAP_H_
@@ -0,0 +1,405 @@
+/**
+ *
+ */
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <limits>
+#include <vector>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "corpus.h"
+#include "log.h"
+
+
+namespace ime
+{
+
+bool Corpus::convert(std::istream &is, const std::string &fname)
+{
+    std::ofstream os(fname, std::ios::binary | std::ios::trunc);
+    if (!os)
+    {
+        ERROR << "cannot open " << fname << std::endl;
+        return false;
+    }
+
+    // 先写占位的文件头，样本表写完后再回填
+    Header header;
+    memset(&header, 0, sizeof(header));
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    std::vector<Entry> entries;
+    uint64_t offset = sizeof(header);
+    while (!is.eof())
+    {
+        std::string line;
+        std::string code;
+        std::string text;
+        double weight;
+
+        std::getline(is, line);
+        if (parse_sample(line, code, text, weight))
+        {
+            entries.push_back({
+                offset,
+                static_cast<uint32_t>(code.length()),
+                static_cast<uint32_t>(text.length()),
+                weight
+            });
+            os.write(code.data(), code.length());
+            os.write(text.data(), text.length());
+            offset += code.length() + text.length();
+        }
+    }
+
+    // 样本表按 8 字节对齐，映射后可以直接访问
+    static const char padding[sizeof(uint64_t)] = {};
+    auto pad = (sizeof(uint64_t) - offset % sizeof(uint64_t)) % sizeof(uint64_t);
+    os.write(padding, pad);
+    offset += pad;
+
+    os.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(Entry));
+
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.count = entries.size();
+    header.table_offset = offset;
+    os.seekp(0);
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    if (!os)
+    {
+        ERROR << "failed to write " << fname << std::endl;
+        return false;
+    }
+
+    INFO << "converted " << entries.size() << " samples to " << fname << std::endl;
+    return true;
+}
+
+bool Corpus::convert(const std::string &text_file, const std::string &fname)
+{
+    std::ifstream is(text_file);
+    if (!is)
+    {
+        ERROR << "cannot open " << text_file << std::endl;
+        return false;
+    }
+
+    return convert(is, fname);
+}
+
+bool Corpus::open(const std::string &fname)
+{
+    close();
+
+    auto fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        ERROR << "cannot open " << fname << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (static_cast<size_t>(st.st_size) < sizeof(Header)))
+    {
+        ERROR << "invalid corpus file " << fname << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        ERROR << "cannot mmap " << fname << std::endl;
+        return false;
+    }
+
+    data = p;
+    length = st.st_size;
+
+    auto header = static_cast<const Header *>(data);
+    if ((memcmp(header->magic, magic, sizeof(magic)) != 0)
+        || (header->version != version)
+        || (header->table_offset % sizeof(uint64_t) != 0)
+        || (header->table_offset < sizeof(Header))
+        || (header->table_offset > length)
+        || ((length - header->table_offset) / sizeof(Entry) != header->count)
+        || ((length - header->table_offset) % sizeof(Entry) != 0))
+    {
+        ERROR << "invalid corpus file " << fname << std::endl;
+        close();
+        return false;
+    }
+
+    // 样本下标以 32 位保存，见 EpochScheduler
+    if (header->count > std::numeric_limits<uint32_t>::max())
+    {
+        ERROR << "too many samples in " << fname << std::endl;
+        close();
+        return false;
+    }
+
+    samples = reinterpret_cast<const Entry *>(static_cast<const char *>(data) + header->table_offset);
+    _size = header->count;
+
+    // 样本在训练中按下标直接访问，打开时检查一次每个样本都落在文件头和样本表之间，损坏的文件直接拒绝
+    for (size_t i = 0; i < _size; ++i)
+    {
+        auto &entry = samples[i];
+        if ((entry.offset < sizeof(Header))
+            || (entry.offset > header->table_offset)
+            || (static_cast<uint64_t>(entry.code_length) + entry.text_length > header->table_offset - entry.offset))
+        {
+            ERROR << "invalid sample " << i << " in corpus file " << fname << std::endl;
+            close();
+            return false;
+        }
+    }
+
+    INFO << "opened corpus " << fname << ", " << _size << " samples, " << length << " bytes" << std::endl;
+    return true;
+}
+
+bool Corpus::open_text(const std::string &text_file, const std::string &binary_file)
+{
+    struct stat text_stat;
+    if (stat(text_file.c_str(), &text_stat) != 0)
+    {
+        ERROR << "cannot open " << text_file << std::endl;
+        return false;
+    }
+
+    if (binary_file.empty())
+    {
+        auto dir = getenv("TMPDIR");
+        std::string temp_file = std::string((dir != nullptr) && (*dir != '\0') ? dir : "/tmp") + "/corpus-XXXXXX";
+        auto fd = mkstemp(&temp_file[0]);
+        if (fd < 0)
+        {
+            ERROR << "cannot create temporary file " << temp_file << std::endl;
+            return false;
+        }
+        ::close(fd);
+
+        // 映射建立后文件可以删除，内存在 close 之前一直有效
+        auto succ = convert(text_file, temp_file) && open(temp_file);
+        unlink(temp_file.c_str());
+        return succ;
+    }
+
+    struct stat binary_stat;
+    if ((stat(binary_file.c_str(), &binary_stat) != 0)
+        || (binary_stat.st_mtime < text_stat.st_mtime))
+    {
+        if (!convert(text_file, binary_file))
+        {
+            return false;
+        }
+    }
+
+    return open(binary_file);
+}
+
+void Corpus::close()
+{
+    if (data != nullptr)
+    {
+        munmap(data, length);
+    }
+
+    data = nullptr;
+    length = 0;
+    samples = nullptr;
+    _size = 0;
+}
+
+void Corpus::read(
+    size_t begin,
+    size_t end,
+    std::vector<std::string_view> &codes,
+    std::vector<std::string_view> &texts,
+    std::vector<double> &weights
+) const
+{
+    auto n = end - begin;
+    codes.resize(n);
+    texts.resize(n);
+    weights.resize(n);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto sample = (*this)[begin + i];
+        codes[i] = sample.code;
+        texts[i] = sample.text;
+        weights[i] = sample.weight;
+    }
+}
+
+void Corpus::read(
+    const uint32_t *indices,
+    size_t n,
+    std::vector<std::string_view> &codes,
+    std::vector<std::string_view> &texts,
+    std::vector<double> &weights
+) const
+{
+    codes.resize(n);
+    texts.resize(n);
+    weights.resize(n);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        assert(indices[i] < _size);
+
+        auto sample = (*this)[indices[i]];
+        codes[i] = sample.code;
+        texts[i] = sample.text;
+        weights[i] = sample.weight;
+    }
+}
+
+std::vector<uint32_t> EpochScheduler::heldout() const
+{
+    std::vector<uint32_t> indices;
+    for (size_t i = fold; (folds > 0) && (i < corpus.size()); i += folds)
+    {
+        indices.push_back(i);
+    }
+    return indices;
+}
+
+const std::vector<uint32_t> & EpochScheduler::schedule(size_t epoch)
+{
+    if (folds > 0)
+    {
+        order.clear();
+        order.reserve(corpus.size());
+        for (size_t i = 0; i < corpus.size(); ++i)
+        {
+            if (i % folds != fold)
+            {
+                order.push_back(i);
+            }
+        }
+    }
+    else
+    {
+        order.resize(corpus.size());
+        std::iota(order.begin(), order.end(), 0);
+    }
+
+    std::mt19937_64 rng(seed + epoch);
+    if (shuffle)
+    {
+        std::shuffle(order.begin(), order.end(), rng);
+    }
+
+    if (bucket_width > 0)
+    {
+        // 稳定排序，桶内保持打乱后的顺序
+        std::stable_sort(
+            order.begin(),
+            order.end(),
+            [&](uint32_t a, uint32_t b)
+            {
+                return corpus[a].code.length() / bucket_width < corpus[b].code.length() / bucket_width;
+            }
+        );
+    }
+
+    split();
+
+    // 分桶后批次按长度排列，打乱批次顺序，避免每轮都从短样本训练到长样本
+    if (shuffle && (bucket_width > 0))
+    {
+        shuffle_batches(rng);
+    }
+
+    _epoch = epoch + 1;
+    return order;
+}
+
+void EpochScheduler::split()
+{
+    offsets.clear();
+
+    size_t count = 0;
+    size_t tokens = 0;
+    size_t bucket = 0;
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        auto length = corpus[order[i]].code.length();
+        auto b = (bucket_width > 0) ? length / bucket_width : 0;
+        auto full = (token_budget > 0) ? (tokens + length > token_budget) : (count >= batch_size);
+
+        if ((i == 0) || (b != bucket) || ((count > 0) && full))
+        {
+            offsets.push_back(i);
+            count = 0;
+            tokens = 0;
+            bucket = b;
+        }
+
+        ++count;
+        tokens += length;
+    }
+
+    offsets.push_back(order.size());
+}
+
+void EpochScheduler::shard(size_t index, size_t count)
+{
+    assert(!offsets.empty());
+    assert(index < count);
+
+    std::vector<uint32_t> new_order;
+    std::vector<size_t> new_offsets;
+    for (auto b = index; b + 1 < offsets.size(); b += count)
+    {
+        new_offsets.push_back(new_order.size());
+        new_order.insert(new_order.end(), order.begin() + offsets[b], order.begin() + offsets[b + 1]);
+    }
+    new_offsets.push_back(new_order.size());
+
+    order.swap(new_order);
+    offsets.swap(new_offsets);
+}
+
+void EpochScheduler::shuffle_batches(std::mt19937_64 &rng)
+{
+    assert(!offsets.empty());
+
+    std::vector<size_t> batch_order(offsets.size() - 1);
+    std::iota(batch_order.begin(), batch_order.end(), 0);
+    std::shuffle(batch_order.begin(), batch_order.end(), rng);
+
+    std::vector<uint32_t> new_order;
+    std::vector<size_t> new_offsets;
+    new_order.reserve(order.size());
+    new_offsets.reserve(offsets.size());
+    for (auto b : batch_order)
+    {
+        new_offsets.push_back(new_order.size());
+        new_order.insert(new_order.end(), order.begin() + offsets[b], order.begin() + offsets[b + 1]);
+    }
+    new_offsets.push_back(new_order.size());
+
+    order.swap(new_order);
+    offsets.swap(new_offsets);
+}
+
+}   // namespace ime
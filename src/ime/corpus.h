@@ -0,0 +1,268 @@
+/**
+ * 预编码的二进制语料.
+ */
+
+#ifndef _CORPUS_H_
+#define _CORPUS_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+
+namespace ime
+{
+
+/**
+ * 解析一行文本语料 "编码 文本 [权重]"，没有权重列时权重为 1.
+ */
+inline bool parse_sample(
+    const std::string &line,
+    std::string &code,
+    std::string &text,
+    double &weight
+)
+{
+    std::stringstream ss(line);
+    ss >> code >> text;
+    if (!(ss >> weight))
+    {
+        weight = 1;
+    }
+
+    return !code.empty() && !text.empty() && (weight > 0);
+}
+
+/**
+ * 通过 mmap 只读访问的二进制语料，由文本语料一次性转换得到.
+ *
+ * 文件由文件头、样本数据和样本表三部分组成：样本数据是各样本的编码和文本字节首尾相连，
+ * 样本表按顺序记录每个样本在样本数据中的偏移、编码和文本的长度以及权重。
+ * 读取时不需要解析，样本直接以指向映射内存的 string_view 返回，也支持随机访问。
+ * 文件按本机字节序保存，不能跨平台使用
+ */
+class Corpus
+{
+public:
+    struct Sample
+    {
+        std::string_view code;
+        std::string_view text;
+        double weight;
+    };
+
+    Corpus() : data(nullptr), length(0), samples(nullptr), _size(0) {}
+
+    Corpus(const Corpus &) = delete;
+
+    Corpus & operator = (const Corpus &) = delete;
+
+    ~Corpus()
+    {
+        close();
+    }
+
+    /**
+     * 把文本语料转换为二进制语料文件，跳过格式不正确的行.
+     */
+    static bool convert(std::istream &is, const std::string &fname);
+
+    static bool convert(const std::string &text_file, const std::string &fname);
+
+    bool open(const std::string &fname);
+
+    /**
+     * 把文本语料转换为二进制语料后打开.
+     *
+     * binary_file 为空时转换到临时目录（TMPDIR，默认 /tmp）下的文件，映射后立即删除，
+     * 不在文本语料旁边留下文件；指定 binary_file 时作为缓存，不存在或比文本语料旧时才重新转换
+     */
+    bool open_text(const std::string &text_file, const std::string &binary_file = std::string());
+
+    void close();
+
+    bool is_open() const
+    {
+        return data != nullptr;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    Sample operator [] (size_t i) const
+    {
+        auto &entry = samples[i];
+        auto p = static_cast<const char *>(data) + entry.offset;
+        return {
+            std::string_view(p, entry.code_length),
+            std::string_view(p + entry.code_length, entry.text_length),
+            entry.weight
+        };
+    }
+
+    /**
+     * 读取 [begin, end) 范围的样本，编码和文本指向映射的内存，不复制，语料关闭前有效.
+     */
+    void read(
+        size_t begin,
+        size_t end,
+        std::vector<std::string_view> &codes,
+        std::vector<std::string_view> &texts,
+        std::vector<double> &weights
+    ) const;
+
+    /**
+     * 按下标读取 indices 指定的 n 个样本.
+     */
+    void read(
+        const uint32_t *indices,
+        size_t n,
+        std::vector<std::string_view> &codes,
+        std::vector<std::string_view> &texts,
+        std::vector<double> &weights
+    ) const;
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t count;             ///< 样本个数
+        uint64_t table_offset;      ///< 样本表在文件中的偏移
+    };
+
+    struct Entry
+    {
+        uint64_t offset;
+        uint32_t code_length;
+        uint32_t text_length;
+        double weight;
+    };
+
+    static constexpr char magic[8] = {'S', 'I', 'M', 'E', 'C', 'R', 'P', '\0'};
+    static constexpr uint32_t version = 1;
+
+    void *data;
+    size_t length;
+    const Entry *samples;
+    size_t _size;
+};
+
+/**
+ * 训练轮次的样本顺序和批次划分.
+ *
+ * 每轮用种子和轮次初始化随机数发生器，生成语料样本下标的一个随机排列，
+ * 同样的种子得到同样的训练顺序，也可以从任意一轮直接开始。
+ * 语料通过 mmap 随机访问，内存中只保存每个样本 4 字节的下标
+ */
+class EpochScheduler
+{
+public:
+    EpochScheduler(const Corpus &corpus_, uint64_t seed_, bool shuffle_ = true) :
+        corpus(corpus_),
+        order(),
+        offsets(),
+        seed(seed_),
+        shuffle(shuffle_),
+        batch_size(100),
+        bucket_width(0),
+        token_budget(0),
+        folds(0),
+        fold(0),
+        _epoch(0) {}
+
+    /**
+     * 设置批次的组成方式.
+     *
+     * batch_size 为每批的样本个数，token_budget 不为 0 时改为限制每批的编码总长度。
+     * bucket_width 不为 0 时按编码长度分桶，只有长度在同一区间的样本才放在同一批，
+     * 同一批样本的解码开销相近，并行更新时各线程的负载均衡
+     */
+    void batching(size_t batch_size_, size_t bucket_width_ = 0, size_t token_budget_ = 0)
+    {
+        batch_size = std::max<size_t>(batch_size_, 1);
+        bucket_width = bucket_width_;
+        token_budget = token_budget_;
+    }
+
+    /**
+     * 交叉验证时留出第 fold 折（样本 i 属于第 i % folds 折），schedule 只安排其余各折的样本.
+     */
+    void holdout(size_t fold_, size_t folds_)
+    {
+        assert(fold_ < folds_);
+        fold = fold_;
+        folds = folds_;
+    }
+
+    /**
+     * 留出的样本下标，没有调用 holdout 时为空.
+     */
+    std::vector<uint32_t> heldout() const;
+
+    /**
+     * 生成第 epoch 轮（从 0 开始）的样本顺序，shuffle 为 false 时为语料原有顺序.
+     */
+    const std::vector<uint32_t> & schedule(size_t epoch);
+
+    /**
+     * 开始下一轮，返回这一轮的样本顺序.
+     */
+    const std::vector<uint32_t> & next()
+    {
+        return schedule(_epoch);
+    }
+
+    /**
+     * 只保留当前轮次中第 index, index + count, index + 2 * count, ... 批，用于多进程训练时划分数据.
+     */
+    void shard(size_t index, size_t count);
+
+    /**
+     * 当前轮次各批次在样本顺序中的起始位置，最后一个元素为样本个数.
+     */
+    const std::vector<size_t> & batches() const
+    {
+        return offsets;
+    }
+
+    /**
+     * 下一轮的轮次.
+     */
+    size_t epoch() const
+    {
+        return _epoch;
+    }
+
+private:
+    void split();
+
+    void shuffle_batches(std::mt19937_64 &rng);
+
+    const Corpus &corpus;
+    std::vector<uint32_t> order;
+    std::vector<size_t> offsets;
+    uint64_t seed;
+    bool shuffle;
+    size_t batch_size;
+    size_t bucket_width;
+    size_t token_budget;
+    size_t folds;           ///< 交叉验证的折数，0 为使用全部样本
+    size_t fold;            ///< 留出的折
+    size_t _epoch;
+};
+
+}   // namespace ime
+
+#endif  // _CORPUS_H_
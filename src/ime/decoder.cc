@@ -4,50 +4,79 @@
 
 #include <cassert>
 #include <cmath>
+#include <chrono>
+#include <limits>
 #include <string>
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <numeric>
 #include <functional>
 #include <iostream>
 #include <sstream>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "decoder.h"
+#include "alloc.h"
 #include "log.h"
+#include "trace.h"
 #include "dict.h"
 
 
 namespace ime
 {
 
-bool Decoder::decode(
-    const std::string &code,
-    const std::string &text,
+template<typename Features>
+bool BasicDecoder<Features>::decode(
+    std::string_view code,
+    std::string_view text,
     std::vector<std::vector<Node>> &beams,
-    size_t beam_size
+    size_t beam_size,
+    SearchStats *stats
 ) const
 {
+    TRACE_SPAN("decode");
     DEBUG << "decode code = " << code << ", text = " << text << std::endl;
 
+    if (stats != nullptr)
+    {
+        ++stats->decodes;
+    }
+
+    AllocScope allocs;
+    if (stats != nullptr)
+    {
+        allocs.start();
+    }
+
     init_beams(beams, code.length());
     auto succ = begin_decode(code, text, beam_size, beams);
 
     for (size_t pos = 1; succ && (pos <= code.length()); ++pos)
     {
-        succ = advance(code, text, pos, beam_size, beams);
+        succ = advance(code, text, pos, beam_size, beams, stats);
     }
 
     if (succ)
     {
-        succ = end_decode(code, text, beam_size, beams);
+        succ = end_decode(code, text, beam_size, beams, true, stats);
+    }
+
+    if (stats != nullptr)
+    {
+        allocs.stop(stats->allocs.decode);
     }
 
     if (succ)
     {
-        if (LOG_LEVEL <= LOG_DEBUG)
+        if constexpr (LOG_LEVEL <= LOG_DEBUG)
         {
             auto paths = get_paths(beams);
-            output_paths(std::cerr, code, paths);
+            LogLine line;
+            output_paths(line.stream(), code, paths);
         }
         return true;
     }
@@ -58,15 +87,17 @@ bool Decoder::decode(
     }
 }
 
-bool Decoder::decode(
-    const std::string &code,
+template<typename Features>
+bool BasicDecoder<Features>::decode(
+    std::string_view code,
     size_t max_path,
     std::vector<std::vector<Node>> &paths,
-    std::vector<double> &probs
+    std::vector<double> &probs,
+    SearchStats *stats
 ) const
 {
     std::vector<std::vector<Node>> beams;
-    if (decode(code, beams))
+    if (decode(code, "", beams, beam_size, stats))
     {
         assert(!beams.empty());
         assert(!beams.back().empty());
@@ -92,10 +123,11 @@ bool Decoder::decode(
     return false;
 }
 
-bool Decoder::begin_decode(
-    const std::string &code,
-    const std::string &text,
-    size_t beam_size,
+template<typename Features>
+bool BasicDecoder<Features>::begin_decode(
+    std::string_view /* code */,
+    std::string_view /* text */,
+    size_t /* beam_size */,
     std::vector<std::vector<Node>> &beams,
     bool bos
 ) const
@@ -111,12 +143,15 @@ bool Decoder::begin_decode(
     return true;
 }
 
-bool Decoder::end_decode(
-    const std::string &code,
-    const std::string &text,
+template<typename Features>
+bool BasicDecoder<Features>::end_decode(
+    std::string_view code,
+    std::string_view text,
     size_t beam_size,
     std::vector<std::vector<Node>> &beams,
-    bool eos
+    bool eos,
+    SearchStats *stats,
+    BeamIndex *index
 ) const
 {
     // 最后加入一列特殊的节点，以标记归约完全部编码（和文本）的路径
@@ -129,7 +164,7 @@ bool Decoder::end_decode(
         if ((prev_node.code_pos == code.length())
             && (text.empty() || (prev_node.text_pos == text.length())))
         {
-            beam.emplace_back(&prev_node);
+            beam.emplace_back(&prev_node, code.length());
             auto &node = beam.back();
 
             if (eos)
@@ -137,63 +172,77 @@ bool Decoder::end_decode(
                 // 添加一个虚拟的句子结束标识，用于构造 n-gram
                 node.word = &bos_eos;
             }
-
-            make_features(node, code, code.length());
-            model.compute_score(node);
         }
     }
 
     if (!beam.empty())
     {
-        topk(beam, beam_size);
+        compute_scores(beam, stats);
+        topk(beam, beam_size, stats);
 
         VERBOSE << "end decode" << std::endl;
-        if (LOG_LEVEL <= LOG_VERBOSE)
+        if constexpr (LOG_LEVEL <= LOG_VERBOSE)
         {
             auto paths = get_paths(beams);
-            output_paths(std::cerr, code, paths);
+            LogLine line;
+            output_paths(line.stream(), code, paths);
         }
-
-        return true;
     }
-    else
+
+    if (index != nullptr)
     {
-        return false;
+        index->build(beam, prev_beam);
     }
+
+    return !beam.empty();
 }
 
-bool Decoder::advance(
-    const std::string &code,
-    const std::string &text,
+template<typename Features>
+bool BasicDecoder<Features>::advance(
+    std::string_view code,
+    std::string_view text,
     size_t pos,
     size_t beam_size,
-    std::vector<std::vector<Node>> &beams
+    std::vector<std::vector<Node>> &beams,
+    SearchStats *stats,
+    BeamIndex *index
 ) const
 {
+    TRACE_SPAN("advance");
     auto &prev_beam = beams.back();
     beams.emplace_back();
     auto &beam = beams.back();
 
+    // 先生成全部候选节点，再统一计分，节点的得分只依赖上一个集束
     for (auto &prev_node : prev_beam)
     {
-        beam.emplace_back(&prev_node);
+        beam.emplace_back(&prev_node, pos);
         auto &node = beam.back();
-        if (fullfill_shift_constraint(node, code, pos))
-        {
-            make_features(node, code, pos);
-            model.compute_score(node);
-        }
-        else
+        if (!fullfill_shift_constraint(node, code, pos))
         {
             beam.pop_back();
         }
 
         // 根据编码子串从词典查找匹配的词进行归约
+        PhaseMark mark;
+        if ((stats != nullptr) && stats->timed)
+        {
+            mark.start();
+        }
         auto subcode = code.substr(prev_node.code_pos, pos - prev_node.code_pos);
         VERBOSE << "code = " << subcode << std::endl;
-        std::multimap<std::string, Word>::const_iterator begin;
-        std::multimap<std::string, Word>::const_iterator end;
+        std::multimap<std::string, Word, std::less<>>::const_iterator begin;
+        std::multimap<std::string, Word, std::less<>>::const_iterator end;
         dict.find(subcode, begin, end);
+        if (stats != nullptr)
+        {
+            ++stats->lookups;
+            stats->hits += (begin != end);
+            if (stats->timed)
+            {
+                mark.stop(stats->phases.lookup, stats->counters.lookup);
+            }
+        }
         for (auto j = begin; j != end; ++j)
         {
             auto &word = j->second;
@@ -204,8 +253,6 @@ bool Decoder::advance(
             if (fullfill_reduce_constraint(node, code, text, pos))
             {
                 VERBOSE << "code = " << j->first << ", word = " << word.text << std::endl;
-                make_features(node, code, pos);
-                model.compute_score(node);
             }
             else
             {
@@ -216,58 +263,82 @@ bool Decoder::advance(
 
     if (!beam.empty())
     {
-        topk(beam, beam_size);
+        compute_scores(beam, stats);
+        topk(beam, beam_size, stats);
 
         VERBOSE << "pos = " << pos << std::endl;
-        if (LOG_LEVEL <= LOG_VERBOSE)
+        if constexpr (LOG_LEVEL <= LOG_VERBOSE)
         {
             auto paths = get_paths(beams);
-            output_paths(std::cerr, code, paths);
+            LogLine line;
+            output_paths(line.stream(), code, paths);
         }
-
-        return true;
     }
-    else
+
+    // 集束在剪枝后确定，此时建立索引，match 不再为每一步单独遍历集束
+    if (index != nullptr)
     {
-        return false;
+        index->build(beam, prev_beam);
     }
+
+    return !beam.empty();
 }
 
-void Decoder::make_features(
-    Node &node,
-    const std::string &code,
-    size_t pos
-) const
+template<typename Features>
+void BasicDecoder<Features>::compute_scores(std::vector<Node> &beam, SearchStats *stats) const
 {
-    if (node.word != nullptr)
+    if ((stats == nullptr) || !stats->timed)
     {
-        if (!node.word->text.empty())
+        for (auto &node : beam)
         {
-            node.local_features.push_back(std::make_pair("unigram:" + node.word->text, 1));
+            compute_score(node);
         }
+        return;
+    }
 
-        if (node.prev_word != nullptr)
-        {
-            // 回溯前一个词，构造 bigram
-            assert(node.prev_word->word != nullptr);
-            node.local_features.push_back(std::make_pair(
-                "bigram:" + node.prev_word->word->text + "_" + node.word->text,
-                1
-            ));
-        }
+    // 和 compute_score 相同的计算拆成两遍，分别计时
+    std::vector<typename Features::Values> local(beam.size());
+    std::vector<typename Features::Values> global(beam.size());
+
+    PhaseMark mark;
+    mark.start();
+    for (size_t i = 0; i < beam.size(); ++i)
+    {
+        Features::template extract<false>(beam[i], local[i]);
+        Features::template extract<true>(beam[i], global[i]);
     }
+    mark.stop(stats->phases.extract, stats->counters.extract);
 
-    // 当前未匹配编码长度
-    if (node.code_pos < pos)
+    mark.start();
+    for (size_t i = 0; i < beam.size(); ++i)
     {
-        std::stringstream ss;
-        ss << "code_len:" << pos - node.code_pos;
-        node.global_features.push_back(std::make_pair(ss.str(), 1));
+        auto &node = beam[i];
+        node.local_score = (node.prev != nullptr) ? node.prev->local_score : 0;
+        Features::score(model, local[i], node.local_score);
+        node.score = node.local_score;
+        Features::score(model, global[i], node.score);
     }
+    mark.stop(stats->phases.score, stats->counters.score);
 }
 
-void Decoder::topk(std::vector<Node> &beam, size_t beam_size) const
+template<typename Features>
+void BasicDecoder<Features>::topk(std::vector<Node> &beam, size_t beam_size, SearchStats *stats) const
 {
+    TRACE_SPAN("topk");
+    PhaseMark mark;
+    if (stats != nullptr)
+    {
+        // 每个位置（包括结束标识）调用一次，在这里统计候选节点数
+        ++stats->positions;
+        stats->nodes += beam.size();
+        stats->pruned += (beam.size() > beam_size) ? beam.size() - beam_size : 0;
+        stats->max_candidates = std::max<uint64_t>(stats->max_candidates, beam.size());
+        if (stats->timed)
+        {
+            mark.start();
+        }
+    }
+
     std::vector<const Node *> tosort;
     tosort.reserve(beam.size());
     for (auto &node : beam)
@@ -292,9 +363,15 @@ void Decoder::topk(std::vector<Node> &beam, size_t beam_size) const
         new_beam.emplace_back(*node);
     }
     beam.swap(new_beam);
+
+    if ((stats != nullptr) && stats->timed)
+    {
+        mark.stop(stats->phases.topk, stats->counters.topk);
+    }
 }
 
-std::vector<std::vector<Node>> Decoder::get_paths(
+template<typename Features>
+std::vector<std::vector<Node>> BasicDecoder<Features>::get_paths(
     const std::vector<std::vector<Node>> &beams,
     const std::vector<size_t> &indeces
 ) const {
@@ -319,9 +396,10 @@ std::vector<std::vector<Node>> Decoder::get_paths(
     return paths;
 }
 
-std::ostream & Decoder::output_paths(
+template<typename Features>
+std::ostream & BasicDecoder<Features>::output_paths(
     std::ostream &os,
-    const std::string &code,
+    std::string_view code,
     const std::vector<std::vector<Node>> &paths
 ) const {
     for (size_t i = 0; i < paths.size(); ++i)
@@ -342,68 +420,72 @@ std::ostream & Decoder::output_paths(
 
         os << code.substr(rear.code_pos, paths[i].size() - 1 - rear.code_pos) << ' ';
 
-        model.output_score(os, rear);
+        Features::output(os, model, rear);
         os << std::endl;
     }
 
     return os;
 }
 
-bool Decoder::train(std::istream &is, Metrics &metrics)
+template<typename Features>
+bool BasicDecoder<Features>::train(std::istream &is, Metrics &metrics)
 {
-    size_t count = 0;
-    size_t succ = 0;
-    size_t prec = 0;
+    // 统计量按样本权重累加，和展开重复样本后的语料一致
+    size_t lines = 0;
+    double count = 0;
+    double succ = 0;
+    double prec = 0;
     double loss = 0;
-    size_t eu = 0;
+    double eu = 0;
+    SearchStats stats;
 
     while (!is.eof())
     {
         std::string line;
         std::string code;
         std::string text;
+        double weight;
 
         std::getline(is, line);
-        std::stringstream ss(line);
-        ss >> code >> text;
-
-        if (!code.empty() && !text.empty())
+        if (parse_sample(line, code, text, weight))
         {
-            DEBUG << "train sample code = " << code << ", text = " << text << std::endl;
+            DEBUG << "train sample code = " << code << ", text = " << text
+                << ", weight = " << weight << std::endl;
 
             size_t index;
             double prob;
-            auto pos = update(code, text, index, prob);
+            auto pos = update(code, text, weight, index, prob, &stats);
             if (pos > 0)
             {
-                ++succ;
+                succ += weight;
                 if (pos < code.length() + 2)
                 {
-                    ++eu;
+                    eu += weight;
                 }
                 if (index == 0)
                 {
-                    ++prec;
+                    prec += weight;
                 }
-                loss += -log(prob);
+                loss += -log(prob) * weight;
             }
 
-            ++count;
-            if (count % 1000 == 0)
+            count += weight;
+            ++lines;
+            if (lines % 1000 == 0)
             {
-                INFO << count
-                    <<": success rate = " << static_cast<double>(succ) / count
-                    << ", precesion = " << static_cast<double>(prec) / succ
+                INFO << lines
+                    <<": success rate = " << succ / count
+                    << ", precesion = " << prec / succ
                     << ", loss = " << loss / succ
-                    << ", early update rate = " << static_cast<double>(eu) / succ << std::endl;
+                    << ", early update rate = " << eu / succ << std::endl;
             }
         }
     }
 
-    double success = static_cast<double>(succ) / count;
-    double precision = static_cast<double>(prec) / succ;
+    double success = succ / count;
+    double precision = prec / succ;
     loss /= succ;
-    double early_update_rate = static_cast<double>(eu) / succ;
+    double early_update_rate = eu / succ;
 
     INFO << "count = " << count
         << ", success rate = " << success
@@ -416,119 +498,230 @@ bool Decoder::train(std::istream &is, Metrics &metrics)
     metrics.set("precision", precision);
     metrics.set("loss", loss);
     metrics.set("early update rate", early_update_rate);
+    stats.report(metrics, lines);
 
     return true;
 }
 
-bool Decoder::train(std::istream &is, size_t batch_size, Metrics &metrics)
+template<typename Features>
+bool BasicDecoder<Features>::train(std::istream &is, size_t batch_size, Metrics &metrics)
 {
-    size_t batch = 0;
-    size_t count = 0;
-    size_t succ = 0;
-    size_t prec = 0;
-    double loss = 0;
-    size_t eu = 0;
-    std::vector<std::string> codes;
-    std::vector<std::string> texts;
+    std::vector<std::string> lines;
+    return train_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
+        {
+            return read_batch(is, batch_size, lines, codes, texts, weights);
+        },
+        metrics
+    );
+}
 
-    while (!is.eof())
+template<typename Features>
+bool BasicDecoder<Features>::train(const Corpus &corpus, size_t batch_size, Metrics &metrics)
+{
+    size_t pos = 0;
+    return train_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
+        {
+            auto end = std::min(pos + batch_size, corpus.size());
+            corpus.read(pos, end, codes, texts, weights);
+            pos = end;
+            return !codes.empty();
+        },
+        metrics
+    );
+}
+
+template<typename Features>
+bool BasicDecoder<Features>::train(
+    const Corpus &corpus,
+    const std::vector<uint32_t> &order,
+    const std::vector<size_t> &batches,
+    Metrics &metrics,
+    size_t first_batch,
+    const BatchCallback &callback
+)
+{
+    assert(batches.empty() || (batches.back() == order.size()));
+
+    size_t batch = first_batch;
+    return train_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
+        {
+            // 读取下一批时上一批已经更新完毕，读完最后一批后还会再调用一次
+            if ((batch > first_batch) && callback && !callback(batch))
+            {
+                return false;
+            }
+
+            if (batch + 1 >= batches.size())
+            {
+                return false;
+            }
+
+            auto begin = batches[batch];
+            auto end = batches[batch + 1];
+            corpus.read(order.data() + begin, end - begin, codes, texts, weights);
+            ++batch;
+            return true;
+        },
+        metrics
+    );
+}
+
+template<typename Features>
+bool BasicDecoder<Features>::read_batch(
+    std::istream &is,
+    size_t batch_size,
+    std::vector<std::string> &lines,
+    std::vector<std::string_view> &codes,
+    std::vector<std::string_view> &texts,
+    std::vector<double> &weights
+)
+{
+    lines.clear();
+    codes.clear();
+    texts.clear();
+    weights.clear();
+
+    while ((weights.size() < batch_size) && !is.eof())
     {
         std::string line;
         std::string code;
         std::string text;
+        double weight;
 
         std::getline(is, line);
-        std::stringstream ss(line);
-        ss >> code >> text;
-
-        if (!code.empty() && !text.empty())
+        if (parse_sample(line, code, text, weight))
         {
-            DEBUG << "train sample code = " << code << ", text = " << text << std::endl;
+            DEBUG << "sample code = " << code << ", text = " << text
+                << ", weight = " << weight << std::endl;
 
-            codes.push_back(std::move(code));
-            texts.push_back(std::move(text));
-
-            if (codes.size() >= batch_size)
-            {
-                assert(codes.size() == texts.size());
-
-                if (update(codes, texts, succ, prec, loss, eu))
-                {
-                    ++batch;
-                    count += codes.size();
-                    if (batch % 100 == 0)
-                    {
-                        INFO << batch
-                            << ": success rate = " << static_cast<double>(succ) / count
-                            << ", precision = " << static_cast<double>(prec) / succ
-                            << ", loss = " << loss / succ
-                            << ", early update rate = " << static_cast<double>(eu) / succ << std::endl;
-                    }
-
-                    codes.clear();
-                    texts.clear();
-                }
-            }
+            lines.push_back(std::move(code));
+            lines.push_back(std::move(text));
+            weights.push_back(weight);
         }
     }
 
-    if (!codes.empty())
+    // lines 不再增长后才取视图，避免扩容使视图失效
+    for (size_t i = 0; i < lines.size(); i += 2)
+    {
+        codes.emplace_back(lines[i]);
+        texts.emplace_back(lines[i + 1]);
+    }
+
+    return !weights.empty();
+}
+
+template<typename Features>
+template<typename ReadBatch>
+bool BasicDecoder<Features>::train_batches(ReadBatch read, Metrics &metrics)
+{
+    size_t batch = 0;
+    double count = 0;
+    double succ = 0;
+    double prec = 0;
+    double loss = 0;
+    double eu = 0;
+    double util_sum = 0;
+    double util_min = 1;
+    size_t lines = 0;
+    SearchStats stats;
+    std::vector<std::string_view> codes;
+    std::vector<std::string_view> texts;
+    std::vector<double> weights;
+
+    while (read(codes, texts, weights))
     {
         assert(codes.size() == texts.size());
+        assert(codes.size() == weights.size());
 
-        if (update(codes, texts, succ, prec, loss, eu))
+        double util = 0;
+        if (update(codes, texts, weights, succ, prec, loss, eu, util, stats))
         {
             ++batch;
-            count += codes.size();
+            lines += codes.size();
+            count += std::accumulate(weights.cbegin(), weights.cend(), 0.0);
+            util_sum += util;
+            util_min = std::min(util_min, util);
+
+            VERBOSE << "batch " << batch
+                << ": size = " << codes.size()
+                << ", thread utilization = " << util << std::endl;
+
+            if (batch % 100 == 0)
+            {
+                INFO << batch
+                    << ": success rate = " << succ / count
+                    << ", precision = " << prec / succ
+                    << ", loss = " << loss / succ
+                    << ", early update rate = " << eu / succ
+                    << ", thread utilization = " << util_sum / batch << std::endl;
+            }
         }
     }
 
-    double success = static_cast<double>(succ) / count;
-    double precision = static_cast<double>(prec) / succ;
+    double success = succ / count;
+    double precision = prec / succ;
     loss /= succ;
-    double early_update_rate = static_cast<double>(eu) / succ;
+    double early_update_rate = eu / succ;
+    double utilization = (batch > 0) ? util_sum / batch : 0;
+    util_min = (batch > 0) ? util_min : 0;
 
     INFO << "count = " << count
         << ", success rate = " << success
         << ", precision = " << precision
         << ", loss = " << loss
-        << ", early update rate = " << early_update_rate << std::endl;
+        << ", early update rate = " << early_update_rate
+        << ", thread utilization = " << utilization
+        << " (min " << util_min << ")" << std::endl;
 
     metrics.set("count", count);
     metrics.set("success rate", success);
     metrics.set("precision", precision);
     metrics.set("loss", loss);
     metrics.set("early update rate", early_update_rate);
+    metrics.set("thread utilization", utilization);
+    metrics.set("min thread utilization", util_min);
+    stats.report(metrics, lines);
     return true;
 }
 
-size_t Decoder::early_update(
-    const std::string &code,
+template<typename Features>
+size_t BasicDecoder<Features>::early_update(
+    std::string_view code,
     const std::vector<std::vector<Node>> &paths,
     std::vector<std::vector<Node>> &beams,
-    size_t &label
+    size_t &label,
+    SearchStats *stats
 ) const
 {
     assert(!paths.empty());
     assert(paths.front().size() == code.length() + 2);
 
+    if (stats != nullptr)
+    {
+        ++stats->decodes;
+    }
+
     auto succ = true;
     init_beams(beams, code.length());
     begin_decode(code, "", beam_size, beams);
 
     // 为目标路径初始化祖先节点的索引，用于对比路径
     std::vector<size_t> indeces(paths.size(), 0);
+    BeamIndex index;
     size_t pos;
     for (pos = 1; succ && (pos <= code.length()); ++pos)
     {
-        advance(code, "", pos, beam_size, beams);
-        succ = match(beams, paths, pos, indeces);
+        advance(code, "", pos, beam_size, beams, stats, &index);
+        succ = match(beams, paths, pos, indeces, index);
     }
 
     if (succ)
     {
-        end_decode(code, "", beam_size, beams);
-        succ = match(beams, paths, pos, indeces);
+        end_decode(code, "", beam_size, beams, true, stats, &index);
+        succ = match(beams, paths, pos, indeces, index);
     }
 
     if (succ)
@@ -538,6 +731,10 @@ size_t Decoder::early_update(
     else
     {
         DEBUG << "early update pos = " << pos << std::endl;
+        if (stats != nullptr)
+        {
+            ++stats->forced;
+        }
     }
 
     // 搜索结果包含至少一条目标路径，返回排在最前的目标路径
@@ -551,37 +748,148 @@ size_t Decoder::early_update(
     label = indeces[i];
 
     DEBUG << "label = " << label << std::endl;
-    if (LOG_LEVEL <= LOG_DEBUG)
+    if constexpr (LOG_LEVEL <= LOG_DEBUG)
     {
         auto paths = get_paths(beams);
-        output_paths(std::cerr, code, paths);
+        LogLine line;
+        output_paths(line.stream(), code, paths);
     }
 
     return pos;
 }
 
-size_t Decoder::early_update(
-    const std::string &code,
-    const std::string &text,
+template<typename Features>
+size_t BasicDecoder<Features>::max_violation(
+    std::string_view code,
+    const std::vector<std::vector<Node>> &paths,
+    std::vector<std::vector<Node>> &beams,
+    size_t &label,
+    SearchStats *stats
+) const
+{
+    assert(!paths.empty());
+    assert(paths.front().size() == code.length() + 2);
+
+    if (stats != nullptr)
+    {
+        ++stats->decodes;
+    }
+
+    init_beams(beams, code.length());
+    begin_decode(code, "", beam_size, beams);
+
+    std::vector<size_t> indeces(paths.size(), 0);
+    BeamIndex index;
+    size_t violation_pos = 0;
+    size_t violation_label = 0;
+    double max_violation = 0;
+
+    // 记录位置 pos 的违例量，match 保证集束中至少有一条目标路径的节点
+    auto record = [&](size_t pos)
+    {
+        auto &beam = beams[pos];
+        double best = -std::numeric_limits<double>::infinity();
+        for (auto &node : beam)
+        {
+            best = std::max(best, node.score);
+        }
+
+        size_t gold = beam.size();
+        for (auto i : indeces)
+        {
+            if ((i < beam.size()) && ((gold == beam.size()) || (beam[i].score > beam[gold].score)))
+            {
+                gold = i;
+            }
+        }
+        assert(gold < beam.size());
+
+        auto violation = best - beam[gold].score;
+        if (violation > max_violation)
+        {
+            max_violation = violation;
+            violation_pos = pos;
+            violation_label = gold;
+        }
+        else if ((pos == code.length() + 1) && (violation_pos == 0))
+        {
+            // 没有违例，和提早更新一样在最后一步更新
+            violation_pos = pos;
+            violation_label = gold;
+        }
+    };
+
+    // 目标路径掉出集束时 match 把它插回集束，统计插回的次数
+    size_t forced = 0;
+    size_t pos;
+    for (pos = 1; pos <= code.length(); ++pos)
+    {
+        advance(code, "", pos, beam_size, beams, stats, &index);
+        forced += match(beams, paths, pos, indeces, index) ? 0 : 1;
+        record(pos);
+    }
+
+    end_decode(code, "", beam_size, beams, true, stats, &index);
+    forced += match(beams, paths, pos, indeces, index) ? 0 : 1;
+    record(pos);
+
+    if (stats != nullptr)
+    {
+        stats->forced += forced;
+    }
+
+    // 只保留到违例位置的集束，后面的节点不参与更新
+    beams.resize(violation_pos + 1);
+    label = violation_label;
+
+    DEBUG << "max violation pos = " << violation_pos
+        << ", violation = " << max_violation
+        << ", label = " << label << std::endl;
+
+    return violation_pos + 1;
+}
+
+template<typename Features>
+size_t BasicDecoder<Features>::early_update(
+    std::string_view code,
+    std::string_view text,
+    double weight,
     std::vector<std::vector<Node>> &beams,
     std::vector<double> &deltas,
     size_t &label,
-    double &prob
+    double &prob,
+    SearchStats *stats
 ) const
 {
+    AllocScope allocs;
+    if (stats != nullptr)
+    {
+        allocs.start();
+    }
+
     std::vector<std::vector<Node>> dest_beams;
-    if (!decode(code, text, dest_beams))
+    if (!decode(code, text, dest_beams, beam_size, stats))
     {
         // 没有搜索到匹配的路径，增加集束大小再试一次
-        if (!decode(code, text, dest_beams, beam_size * 2))
+        if (stats != nullptr)
+        {
+            ++stats->retries;
+        }
+        if (!decode(code, text, dest_beams, beam_size * 2, stats))
         {
             DEBUG << "cannot decode code = " << code << ", text = " << text << std::endl;
+            if (stats != nullptr)
+            {
+                allocs.stop(stats->allocs.early_update);
+            }
             return 0;
         }
     }
 
     auto paths = get_paths(dest_beams);
-    auto pos = early_update(code, paths, beams, label);
+    auto pos = (_strategy == UpdateStrategy::MAX_VIOLATION)
+        ? max_violation(code, paths, beams, label, stats)
+        : early_update(code, paths, beams, label, stats);
 
     // 计算各路径梯度
     double sum = 0;
@@ -600,17 +908,25 @@ size_t Decoder::early_update(
             prob = p;
             delta += 1;
         }
-        deltas.push_back(delta);
+        // 合并的重复样本按权重放大梯度
+        deltas.push_back(delta * weight);
+    }
+
+    if (stats != nullptr)
+    {
+        allocs.stop(stats->allocs.early_update);
     }
 
     return pos;
 }
 
-bool Decoder::match(
+template<typename Features>
+bool BasicDecoder<Features>::match(
     std::vector<std::vector<Node>> &beams,
     const std::vector<std::vector<Node>> &paths,
     size_t pos,
-    std::vector<size_t> &indeces
+    std::vector<size_t> &indeces,
+    const BeamIndex &index
 ) const
 {
     assert(!paths.empty());
@@ -625,19 +941,16 @@ bool Decoder::match(
     prev_indeces.swap(indeces);
     auto found = false;
 
+    // 每条路径只比较同一前驱的子节点，不用逐个比较集束中的节点
     for (size_t i = 0; i < paths.size(); ++i)
     {
         if (prev_indeces[i] < beams[pos - 1].size())
         {
-            for (size_t j = 0; j < beams[pos].size(); ++j)
+            auto j = index.find(prev_indeces[i], paths[i][pos].word);
+            if (j != BeamIndex::npos)
             {
-                if ((beams[pos][j].prev == &beams[pos - 1][prev_indeces[i]])
-                    && (beams[pos][j].word == paths[i][pos].word))
-                {
-                    indeces[i] = j;
-                    found = true;
-                    break;
-                }
+                indeces[i] = j;
+                found = true;
             }
         }
     }
@@ -656,7 +969,7 @@ bool Decoder::match(
         beams[pos].emplace_back(paths[i][pos]);
         auto &node = beams[pos].back();
         node.prev = &beams[pos - 1][prev_indeces[i]];
-        node.prev_word = (node.prev->word != nullptr) ? node.prev : node.prev_word;
+        node.prev_word = (node.prev->word != nullptr) ? node.prev : node.prev->prev_word;
 
         indeces[i] = beams[pos].size() - 1;
     }
@@ -664,34 +977,56 @@ bool Decoder::match(
     return found;
 }
 
-size_t Decoder::update(
-    const std::string &code,
-    const std::string &text,
+template<typename Features>
+void BasicDecoder<Features>::update(
+    const std::vector<Node> &rears,
+    const std::vector<double> &deltas
+)
+{
+    assert(!model.frozen());
+    assert(rears.size() == deltas.size());
+
+    // 先收集一个样本全部路径的特征，合并后每个特征只更新一次
+    std::vector<typename Features::Update> updates;
+    for (size_t i = 0; i < rears.size(); ++i)
+    {
+        DEBUG << "update: " << rears[i] << " +" << deltas[i] << std::endl;
+        Features::collect(rears[i], deltas[i], updates);
+    }
+    Features::update(model, updates);
+}
+
+template<typename Features>
+size_t BasicDecoder<Features>::update(
+    std::string_view code,
+    std::string_view text,
+    double weight,
     size_t &index,
-    double &prob
+    double &prob,
+    SearchStats *stats
 )
 {
+    TRACE_SPAN("update");
+    model.thaw();
+
     std::vector<std::vector<Node>> beams;
     std::vector<double> deltas;
-    auto pos = early_update(code, text, beams, deltas, index, prob);
+    auto pos = early_update(code, text, weight, beams, deltas, index, prob, stats);
     if (pos > 0)
     {
         assert(beams.back().size() == deltas.size());
 
-        std::vector<Features> features;
-        features.reserve(beams.back().size());
-        features.insert(
-            features.end(),
-            beams.back().cbegin(),
-            beams.back().cend()
-        );
-
-        model.update(
-            features.begin(),
-            features.end(),
-            deltas.begin(),
-            deltas.end()
-        );
+        PhaseMark mark;
+        if ((stats != nullptr) && stats->timed)
+        {
+            mark.start();
+        }
+        update(beams.back(), deltas);
+        if ((stats != nullptr) && stats->timed)
+        {
+            mark.stop(stats->phases.update, stats->counters.update);
+        }
+        model.reclaim();
     }
     else
     {
@@ -701,16 +1036,27 @@ size_t Decoder::update(
     return pos;
 }
 
-void Decoder::update(
-    const std::vector<std::string> &codes,
-    const std::vector<std::string> &texts,
+template<typename Features>
+void BasicDecoder<Features>::update(
+    const std::vector<std::string_view> &codes,
+    const std::vector<std::string_view> &texts,
+    const std::vector<double> &weights,
     std::vector<size_t> &positions,
     std::vector<size_t> &indeces,
-    std::vector<double> &probs
+    std::vector<double> &probs,
+    double &utilization,
+    SearchStats &stats
 )
 {
+    TRACE_SPAN("update");
     assert(codes.size() == texts.size());
+    assert(codes.size() == weights.size());
 
+    model.thaw();
+
+    // 包括各线程计算梯度和更新模型的分配
+    AllocScope allocs;
+    allocs.start(true);
     auto batch_size = codes.size();
     std::vector<std::vector<std::vector<Node>>> batch_beams(batch_size);
     std::vector<std::vector<double>> batch_deltas(batch_size);
@@ -718,21 +1064,47 @@ void Decoder::update(
     indeces.resize(batch_size);
     probs.resize(batch_size);
 
-#pragma omp parallel for num_threads(8)
+    // 各样本计算梯度的耗时，用于统计线程利用率
+    std::vector<double> busy(batch_size);
+    std::vector<SearchStats> sample_stats(batch_size);
+    size_t team = 1;
+    auto start = std::chrono::steady_clock::now();
+
+#pragma omp parallel for num_threads(_threads)
     // 并行计算梯度
     for (size_t i = 0; i < batch_size; ++i)
     {
+        auto begin = std::chrono::steady_clock::now();
         positions[i] = early_update(
             codes[i],
             texts[i],
+            weights[i],
             batch_beams[i],
             batch_deltas[i],
             indeces[i],
-            probs[i]
+            probs[i],
+            &sample_stats[i]
         );
+        busy[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+#ifdef _OPENMP
+        if (i == 0)
+        {
+            team = omp_get_num_threads();
+        }
+#endif
+    }
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto total = std::accumulate(busy.cbegin(), busy.cend(), 0.0);
+    utilization = (elapsed > 0) ? std::min(total / (team * elapsed), 1.0) : 1.0;
+    for (auto &s : sample_stats)
+    {
+        stats += s;
     }
 
-    // 批量更新模型
+    // 批量更新模型，模型的权重表支持并发更新
+#pragma omp parallel for num_threads(_threads)
     for (size_t i = 0; i < batch_size; ++i)
     {
         if (positions[i] > 0)
@@ -740,73 +1112,80 @@ void Decoder::update(
             auto &rear = batch_beams[i].back();
             assert(rear.size() == batch_deltas[i].size());
 
-            std::vector<Features> features;
-            features.reserve(rear.size());
-            features.insert(features.end(), rear.cbegin(), rear.cend());
-
-            model.update(
-                features.begin(),
-                features.end(),
-                batch_deltas[i].begin(),
-                batch_deltas[i].end()
-            );
+            update(rear, batch_deltas[i]);
         }
     }
+
+    // 并行更新已经结束，没有其他线程访问权重表
+    model.reclaim();
+    allocs.stop(stats.allocs.batch);
 }
 
-bool Decoder::update(
-    const std::vector<std::string> &codes,
-    const std::vector<std::string> &texts,
-    size_t &success,
-    size_t &precision,
+template<typename Features>
+bool BasicDecoder<Features>::update(
+    const std::vector<std::string_view> &codes,
+    const std::vector<std::string_view> &texts,
+    const std::vector<double> &weights,
+    double &success,
+    double &precision,
     double &loss,
-    size_t &early_update_count
+    double &early_update_count,
+    double &utilization,
+    SearchStats &stats
 )
 {
     std::vector<size_t> positions;
     std::vector<size_t> indeces;
     std::vector<double> probs;
-    update(codes, texts, positions, indeces, probs);
+    update(codes, texts, weights, positions, indeces, probs, utilization, stats);
 
     for (size_t i = 0; i < codes.size(); ++i)
     {
         if (positions[i] > 0)
         {
-            ++success;
+            success += weights[i];
             if (positions[i] < codes[i].length() + 2)
             {
-                ++early_update_count;
+                early_update_count += weights[i];
             }
             if (indeces[i] == 0)
             {
-                ++precision;
+                precision += weights[i];
             }
-            loss -= log(probs[i]);
+            loss -= log(probs[i]) * weights[i];
         }
     }
 
     return true;
 }
 
-int Decoder::predict(
-    const std::string &code,
-    const std::string &text,
-    double &prob
+template<typename Features>
+int BasicDecoder<Features>::predict(
+    std::string_view code,
+    std::string_view text,
+    double &prob,
+    SearchStats *stats
 ) const
 {
     int index = -1;
     std::vector<std::string> texts;
     std::vector<double> probs;
-    if (predict(code, texts, probs))
+    if (predict(code, texts, probs, stats))
     {
         assert(!texts.empty());
         assert(!probs.empty());
         assert(texts.size() == probs.size());
 
-        for (index = 0; (index < texts.size()) && (texts[index] != text); ++index);
-        if (index < texts.size())
+        size_t i = 0;
+        while ((i < texts.size()) && (texts[i] != text))
         {
-            prob = probs[index];
+            ++i;
+        }
+
+        if (i < texts.size())
+        {
+            index = static_cast<int>(i);
+            prob = probs[i];
         }
         else
         {
@@ -814,7 +1193,7 @@ int Decoder::predict(
 
             // 预测结果中没有包含目标文本，无法计算概率，限定文本解码以获取目标文本分数
             std::vector<std::vector<Node>> beams;
-            decode(code, beams);
+            decode(code, "", beams, beam_size, stats);
             assert(!beams.empty());
             assert(!beams.back().empty());
 
@@ -825,11 +1204,11 @@ int Decoder::predict(
             }
 
             beams.clear();
-            if (decode(code, text, beams))
+            if (decode(code, text, beams, beam_size, stats))
             {
                 assert(!beams.empty());
                 assert(!beams.back().empty());
-                index = beam_size;
+                index = static_cast<int>(beam_size);
                 sum += exp(beams.back().front().score);
                 prob = exp(beams.back().front().score) / sum;
             }
@@ -850,123 +1229,261 @@ int Decoder::predict(
     return index;
 }
 
-bool Decoder::evaluate(std::istream &is, Metrics &metrics) const
+template<typename Features>
+bool BasicDecoder<Features>::evaluate(std::istream &is, Metrics &metrics) const
 {
-    size_t count = 0;
-    size_t succ = 0;
-    size_t prec = 0;
-    size_t inbeam = 0;
+    double count = 0;
+    double succ = 0;
+    double prec = 0;
+    double inbeam = 0;
     double loss = 0;
+    size_t lines = 0;
+    SearchStats stats;
 
     while (!is.eof())
     {
         std::string line;
         std::string code;
         std::string text;
+        double weight;
 
         std::getline(is, line);
-        std::stringstream ss(line);
-        ss >> code >> text;
-
-        if (!code.empty() && !text.empty())
+        if (parse_sample(line, code, text, weight))
         {
             DEBUG << "evaluation sample code = " << code << ", text = " << text << std::endl;
 
-            ++count;
+            count += weight;
+            ++lines;
             double prob = 0;
-            auto index = predict(code, text, prob);
+            auto index = predict(code, text, prob, &stats);
             if (index >= 0)
             {
-                ++succ;
-                if (index < beam_size)
+                succ += weight;
+                if (static_cast<size_t>(index) < beam_size)
                 {
-                    ++inbeam;
+                    inbeam += weight;
                     if (index == 0)
                     {
-                        ++prec;
+                        prec += weight;
                     }
                 }
 
-                loss -= log(prob);
+                loss -= log(prob) * weight;
             }
         }
     }
 
     metrics.set("count", count);
-    metrics.set("success rate", static_cast<double>(succ) / count);
-    metrics.set("precision", static_cast<double>(prec) / succ);
+    metrics.set("success rate", succ / count);
+    metrics.set("precision", prec / succ);
     std::stringstream ss;
     ss << "p@" << beam_size;
-    metrics.set(ss.str(), static_cast<double>(inbeam) / succ);
+    metrics.set(ss.str(), inbeam / succ);
     metrics.set("loss", loss / succ);
+    stats.report(metrics, lines);
     return true;
 }
 
-bool Decoder::evaluate(std::istream &is, size_t batch_size, Metrics &metrics) const
+template<typename Features>
+bool BasicDecoder<Features>::evaluate(std::istream &is, size_t batch_size, Metrics &metrics) const
 {
-    size_t count = 0;
-    size_t succ = 0;
-    size_t prec = 0;
-    size_t inbeam = 0;
-    double loss = 0;
+    std::vector<std::string> lines;
+    return evaluate_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
+        {
+            return read_batch(is, batch_size, lines, codes, texts, weights);
+        },
+        metrics
+    );
+}
 
-    while (!is.eof())
-    {
-        std::vector<std::string> codes;
-        std::vector<std::string> texts;
-        for (size_t i = 0; (i < batch_size) && !is.eof(); ++i)
+template<typename Features>
+bool BasicDecoder<Features>::evaluate(const Corpus &corpus, size_t batch_size, Metrics &metrics) const
+{
+    size_t pos = 0;
+    return evaluate_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
+        {
+            auto end = std::min(pos + batch_size, corpus.size());
+            corpus.read(pos, end, codes, texts, weights);
+            pos = end;
+            return !codes.empty();
+        },
+        metrics
+    );
+}
+
+template<typename Features>
+bool BasicDecoder<Features>::evaluate(
+    const Corpus &corpus,
+    const std::vector<uint32_t> &indices,
+    size_t batch_size,
+    Metrics &metrics
+) const
+{
+    size_t pos = 0;
+    return evaluate_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
+        {
+            auto end = std::min(pos + batch_size, indices.size());
+            corpus.read(indices.data() + pos, end - pos, codes, texts, weights);
+            pos = end;
+            return !codes.empty();
+        },
+        metrics
+    );
+}
+
+template<typename Features>
+bool BasicDecoder<Features>::evaluate(
+    std::istream &is,
+    size_t batch_size,
+    Metrics &metrics,
+    EvaluationReport &report
+) const
+{
+    std::vector<std::string> lines;
+    return evaluate_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
         {
-            std::string line;
-            std::string code;
-            std::string text;
+            return read_batch(is, batch_size, lines, codes, texts, weights);
+        },
+        metrics,
+        &report
+    );
+}
 
-            std::getline(is, line);
-            std::stringstream ss(line);
-            ss >> code >> text;
+template<typename Features>
+bool BasicDecoder<Features>::evaluate(
+    const Corpus &corpus,
+    size_t batch_size,
+    Metrics &metrics,
+    EvaluationReport &report
+) const
+{
+    size_t pos = 0;
+    return evaluate_batches(
+        [&](std::vector<std::string_view> &codes, std::vector<std::string_view> &texts, std::vector<double> &weights)
+        {
+            auto end = std::min(pos + batch_size, corpus.size());
+            corpus.read(pos, end, codes, texts, weights);
+            pos = end;
+            return !codes.empty();
+        },
+        metrics,
+        &report
+    );
+}
 
-            if (!code.empty() && !text.empty())
-            {
-                DEBUG << "evaluation sample code = " << code << ", text = " << text << std::endl;
-                codes.push_back(std::move(code));
-                texts.push_back(std::move(text));
-            }
+template<typename Features>
+template<typename ReadBatch>
+bool BasicDecoder<Features>::evaluate_batches(ReadBatch read, Metrics &metrics, EvaluationReport *report) const
+{
+    double count = 0;
+    double succ = 0;
+    double prec = 0;
+    double inbeam = 0;
+    double loss = 0;
+    std::vector<std::string_view> codes;
+    std::vector<std::string_view> texts;
+    std::vector<double> weights;
+    std::vector<SampleRecord> records;
+    std::vector<SearchStats> sample_stats;
+    size_t lines = 0;
+    SearchStats stats;
+
+    if (report != nullptr)
+    {
+        report->setup(beam_size, _threads);
+    }
+
+    while (read(codes, texts, weights))
+    {
+        assert(codes.size() == texts.size());
+        assert(codes.size() == weights.size());
+        count += std::accumulate(weights.cbegin(), weights.cend(), 0.0);
+        lines += codes.size();
+
+        // 各线程只写自己样本的记录和统计量，这一批结束后再按顺序汇总
+        if (report != nullptr)
+        {
+            records.assign(codes.size(), SampleRecord());
+        }
+        else
+        {
+            sample_stats.assign(codes.size(), SearchStats());
         }
+        auto start = std::chrono::steady_clock::now();
 
-        if (!codes.empty())
+#pragma omp parallel for num_threads(_threads) reduction(+:succ, prec, inbeam, loss)
+        for (size_t i = 0; i < codes.size(); ++i)
         {
-            assert(codes.size() == texts.size());
-            count += codes.size();
+            double prob = 0;
+            int index;
+            if (report != nullptr)
+            {
+                auto &record = records[i];
+                auto begin = std::chrono::steady_clock::now();
+                index = predict(codes[i], texts[i], prob, &record.stats);
+                record.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                record.code = codes[i];
+                record.weight = weights[i];
+                record.index = index;
+#ifdef _OPENMP
+                record.thread = omp_get_thread_num();
+#else
+                record.thread = 0;
+#endif
+            }
+            else
+            {
+                index = predict(codes[i], texts[i], prob, &sample_stats[i]);
+            }
 
-#pragma omp parallel for num_threads(8)
-            for (size_t i = 0; i < codes.size(); ++i)
+            if (index >= 0)
             {
-                double prob = 0;
-                auto index = predict(codes[i], texts[i], prob);
-                if (index >= 0)
+                succ += weights[i];
+                loss -= log(prob) * weights[i];
+                if (static_cast<size_t>(index) < beam_size)
                 {
-                    ++succ;
-                    loss -= log(prob);
-                    if (index < beam_size)
+                    inbeam += weights[i];
+                    if (index == 0)
                     {
-                        ++inbeam;
-                        if (index == 0)
-                        {
-                            ++prec;
-                        }
+                        prec += weights[i];
                     }
                 }
             }
         }
+
+        if (report != nullptr)
+        {
+            report->elapse(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            for (auto &record : records)
+            {
+                stats += record.stats;
+                report->add(record);
+            }
+        }
+        else
+        {
+            for (auto &s : sample_stats)
+            {
+                stats += s;
+            }
+        }
     }
 
     metrics.set("count", count);
-    metrics.set("success rate", static_cast<double>(succ) / count);
-    metrics.set("precision", static_cast<double>(prec) / succ);
+    metrics.set("success rate", succ / count);
+    metrics.set("precision", prec / succ);
     std::stringstream ss;
     ss << "p@" << beam_size;
-    metrics.set(ss.str(), static_cast<double>(inbeam) / succ);
+    metrics.set(ss.str(), inbeam / succ);
     metrics.set("loss", loss / succ);
+    stats.report(metrics, lines);
     return true;
 }
 
+template class BasicDecoder<DefaultFeatureSet>;
+
 }   // namespace ime
@@ -6,8 +6,12 @@
 #define _DECODER_H_
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <memory>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -15,29 +19,121 @@
 #include "log.h"
 #include "common.h"
 #include "dict.h"
+#include "corpus.h"
+#include "feature.h"
 #include "model.h"
+#include "checkpoint.h"
+#include "mixing.h"
+#include "beam_index.h"
+#include "report.h"
 
 
 namespace ime
 {
 
-class Decoder
+/**
+ * 结构化感知机训练时选择更新位置的策略.
+ */
+enum class UpdateStrategy
+{
+    EARLY,          ///< 提早更新，在所有目标路径掉出集束的第一个位置更新
+    MAX_VIOLATION   ///< 最大违例更新，搜索到最后，在最优路径和目标路径得分差最大的位置更新
+};
+
+/**
+ * 输入法解码器，Features 为特征模板列表（见 FeatureSet）.
+ *
+ * 特征的提取和计分随 Features 在编译期展开，
+ * 成员函数在 decoder.cc 中对 DefaultFeatureSet 显式实例化，使用其他模板列表时需另行实例化
+ */
+template<typename Features>
+class BasicDecoder
 {
 public:
-    Decoder(
+    BasicDecoder(
+        const Dictionary &dict_,
+        size_t beam_size_ = 20
+    ) : beam_size(beam_size_), dict(dict_), model(dict_), bos_eos(), _threads(8), _strategy(UpdateStrategy::EARLY)
+    {
+        Features::register_templates(model);
+    }
+
+    /**
+     * 以模型快照（见 snapshot）构造解码器，用于和训练同时进行的评估，构造时冻结模型.
+     */
+    BasicDecoder(
         const Dictionary &dict_,
+        const Model &model_,
         size_t beam_size_ = 20
-    ) : dict(dict_), beam_size(beam_size_), model(), bos_eos() {}
+    ) : beam_size(beam_size_), dict(dict_), model(model_), bos_eos(), _threads(8), _strategy(UpdateStrategy::EARLY)
+    {
+        model.freeze();
+    }
 
+    /**
+     * 接管模型快照构造解码器，不再复制一份权重.
+     */
+    BasicDecoder(
+        const Dictionary &dict_,
+        Model &&model_,
+        size_t beam_size_ = 20
+    ) : beam_size(beam_size_), dict(dict_), model(std::move(model_)), bos_eos(), _threads(8), _strategy(UpdateStrategy::EARLY)
+    {
+        model.freeze();
+    }
+
+    /**
+     * 解码的集束宽度，可以在两次评估之间修改，用于在同一模型上比较不同的集束宽度.
+     */
+    size_t beam() const
+    {
+        return beam_size;
+    }
+
+    void beam(size_t n)
+    {
+        beam_size = std::max<size_t>(n, 1);
+    }
+
+    /**
+     * 批量训练和评估使用的线程数.
+     */
+    size_t threads() const
+    {
+        return _threads;
+    }
+
+    void threads(size_t n)
+    {
+        _threads = std::max<size_t>(n, 1);
+    }
+
+    /**
+     * 训练时选择更新位置的策略，默认为提早更新.
+     */
+    UpdateStrategy strategy() const
+    {
+        return _strategy;
+    }
+
+    void strategy(UpdateStrategy s)
+    {
+        _strategy = s;
+    }
+
+    /**
+     * 解码，stats 不为空时累加搜索统计量，stats->timed 为 true 时还累加各阶段的耗时（见 SearchStats）.
+     */
     bool decode(
-        const std::string &code,
-        const std::string &text,
+        std::string_view code,
+        std::string_view text,
         std::vector<std::vector<Node>> &beams,
-        size_t beam_size
+        size_t beam_size,
+        SearchStats *stats = nullptr
     ) const;
 
     bool decode(
-        const std::string &code,
+        std::string_view code,
         std::vector<std::vector<Node>> &beams
     ) const
     {
@@ -45,8 +141,8 @@ public:
     }
 
     bool decode(
-        const std::string &code,
-        const std::string &text,
+        std::string_view code,
+        std::string_view text,
         std::vector<std::vector<Node>> &beams
     ) const
     {
@@ -54,13 +150,14 @@ public:
     }
 
     bool decode(
-        const std::string &code,
+        std::string_view code,
         size_t max_path,
         std::vector<std::vector<Node>> &paths,
-        std::vector<double> &probs
+        std::vector<double> &probs,
+        SearchStats *stats = nullptr
     ) const;
 
-    std::vector<std::vector<Node>> decode(const std::string &code, size_t max_path = 10) const
+    std::vector<std::vector<Node>> decode(std::string_view code, size_t max_path = 10) const
     {
         std::vector<std::vector<Node>> beams;
         decode(code, beams);
@@ -69,51 +166,74 @@ public:
 
     std::ostream & output_paths(
         std::ostream &os,
-        const std::string &code,
+        std::string_view code,
         const std::vector<std::vector<Node>> &paths
     ) const;
 
+    /**
+     * 用一个样本更新模型，weight 为样本的权重（合并的重复样本个数），梯度按权重放大.
+     *
+     * stats 不为空时累加解码和强制搜索的统计量，stats->timed 为 true 时还累加各阶段和更新权重的耗时
+     */
     size_t update(
-        const std::string &code,
-        const std::string &text,
+        std::string_view code,
+        std::string_view text,
+        double weight,
         size_t &index,
-        double &prob
+        double &prob,
+        SearchStats *stats = nullptr
     );
 
+    /**
+     * 批量更新模型，多线程并行计算各样本的梯度.
+     *
+     * utilization 返回计算梯度阶段的线程利用率，即各线程忙碌时间之和与线程数乘以耗时之比，
+     * 同一批样本长短悬殊时先完成的线程空等，利用率下降；stats 累加这一批的搜索统计量
+     */
     void update(
-        const std::vector<std::string> &codes,
-        const std::vector<std::string> &texts,
+        const std::vector<std::string_view> &codes,
+        const std::vector<std::string_view> &texts,
+        const std::vector<double> &weights,
         std::vector<size_t> &positions,
         std::vector<size_t> &indeces,
-        std::vector<double> &probs
+        std::vector<double> &probs,
+        double &utilization,
+        SearchStats &stats
     );
 
+    /**
+     * 批量更新模型，统计量按样本权重累加，utilization 返回这一批的线程利用率.
+     */
     bool update(
-        const std::vector<std::string> &codes,
-        const std::vector<std::string> &texts,
-        size_t &success,
-        size_t &precision,
+        const std::vector<std::string_view> &codes,
+        const std::vector<std::string_view> &texts,
+        const std::vector<double> &weights,
+        double &success,
+        double &precision,
         double &loss,
-        size_t &early_update_count
+        double &early_update_count,
+        double &utilization,
+        SearchStats &stats
     );
 
-    std::vector<std::string> predict(const std::string &code, size_t num = 1) const
+    std::vector<std::string> predict(std::string_view code, size_t num = 1) const
     {
         auto paths = decode(code, num);
         return get_texts(paths);
     }
 
     bool predict(
-        const std::string &code,
+        std::string_view code,
         size_t num,
         std::vector<std::string> &texts,
-        std::vector<double> &probs
+        std::vector<double> &probs,
+        SearchStats *stats = nullptr
     ) const
     {
         DEBUG << "predict code = " << code << std::endl;
 
         std::vector<std::vector<Node>> paths;
-        if (decode(code, num, paths, probs))
+        if (decode(code, num, paths, probs, stats))
         {
             texts = get_texts(paths);
 
@@ -130,20 +250,27 @@ public:
     }
 
     bool predict(
-        const std::string &code,
+        std::string_view code,
         std::vector<std::string> &texts,
-        std::vector<double> &probs
+        std::vector<double> &probs,
+        SearchStats *stats = nullptr
     ) const
     {
-        return predict(code, beam_size, texts, probs);
+        return predict(code, beam_size, texts, probs, stats);
     }
 
     int predict(
-        const std::string &code,
-        const std::string &text,
-        double &prob
+        std::string_view code,
+        std::string_view text,
+        double &prob,
+        SearchStats *stats = nullptr
     ) const;
 
+    /**
+     * 训练模型，语料每行为 "编码 文本 [权重]".
+     *
+     * 权重为合并的重复样本个数（见 script/compact.py），样本的梯度按权重放大
+     */
     bool train(std::istream &is, Metrics &metrics);
 
     /**
@@ -151,6 +278,32 @@ public:
      */
     bool train(std::istream &is, size_t batch_size, Metrics &metrics);
 
+    /**
+     * 从预编码的二进制语料训练模型，批量更新版本.
+     */
+    bool train(const Corpus &corpus, size_t batch_size, Metrics &metrics);
+
+    /**
+     * 每完成一批调用一次，参数为这一轮已完成的批次数，返回 false 时提前结束这一轮.
+     */
+    typedef std::function<bool (size_t)> BatchCallback;
+
+    /**
+     * 按 order 给出的样本顺序训练一轮，第 i 批为 order 中 [batches[i], batches[i + 1]) 的样本.
+     *
+     * order 和 batches 通常由 EpochScheduler 生成。从第 first_batch 批开始训练，
+     * 用于从检查点恢复；callback 在两批之间调用，此时可以复制模型（snapshot），
+     * 也可以返回 false 停止训练（如提前终止）
+     */
+    bool train(
+        const Corpus &corpus,
+        const std::vector<uint32_t> &order,
+        const std::vector<size_t> &batches,
+        Metrics &metrics,
+        size_t first_batch = 0,
+        const BatchCallback &callback = nullptr
+    );
+
     bool train(const std::string &fname, Metrics &metrics, size_t batch_size = 1)
     {
         std::ifstream is(fname);
@@ -168,6 +321,27 @@ public:
 
     bool evaluate(std::istream &is, size_t batch_size, Metrics &metrics) const;
 
+    bool evaluate(const Corpus &corpus, size_t batch_size, Metrics &metrics) const;
+
+    /**
+     * 只评估语料中下标为 indices 的样本，用于交叉验证.
+     */
+    bool evaluate(
+        const Corpus &corpus,
+        const std::vector<uint32_t> &indices,
+        size_t batch_size,
+        Metrics &metrics
+    ) const;
+
+    /**
+     * 评估并记录每个样本的延迟和各阶段耗时，用于生成评估报告.
+     *
+     * 分阶段计时只在这两个版本中进行，其他版本的评估和训练不计时
+     */
+    bool evaluate(std::istream &is, size_t batch_size, Metrics &metrics, EvaluationReport &report) const;
+
+    bool evaluate(const Corpus &corpus, size_t batch_size, Metrics &metrics, EvaluationReport &report) const;
+
     bool evaluate(
         const std::string &fname,
         Metrics &metrics,
@@ -190,12 +364,104 @@ public:
         return model.save(fname);
     }
 
+    /**
+     * 载入模型用于预测，载入后模型即被冻结.
+     */
     bool load(const std::string &fname)
     {
-        return model.load(fname);
+        if (model.load(fname))
+        {
+            model.freeze();
+            return true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    void freeze()
+    {
+        model.freeze();
+    }
+
+    void thaw()
+    {
+        model.thaw();
+    }
+
+    /**
+     * 切换到 2^bits 个槽位的哈希特征空间，返回冲突率，见 Model::hash.
+     */
+    double hash(size_t bits)
+    {
+        return model.hash(bits);
+    }
+
+    /**
+     * 设置训练时的特征准入阈值，见 Model::admit.
+     */
+    void admit(size_t threshold, size_t sketch_bits = 20)
+    {
+        model.admit(threshold, sketch_bits);
+    }
+
+    /**
+     * 复制当前模型，见 Model::snapshot，不能和训练同时调用.
+     */
+    std::unique_ptr<Model> snapshot() const
+    {
+        return model.snapshot();
+    }
+
+    /**
+     * 从检查点恢复模型和训练进度，恢复后模型保持可更新的状态.
+     */
+    bool resume(Checkpointer &checkpointer, TrainState &state)
+    {
+        return checkpointer.load(model, state);
+    }
+
+    /**
+     * 以当前模型作为多进程参数混合的起点，见 ParameterMixer.
+     */
+    void begin_mixing(ParameterMixer &mixer) const
+    {
+        mixer.reset(model);
+    }
+
+    /**
+     * 和其他训练进程混合参数，不能和训练同时调用.
+     */
+    bool mix(ParameterMixer &mixer)
+    {
+        return mixer.mix(model);
     }
 
 private:
+    /**
+     * 从文本语料读取最多 batch_size 个样本，没有读到样本时返回 false.
+     *
+     * 样本的编码和文本依次保存在 lines 中，codes 和 texts 指向 lines，下一次读取前有效
+     */
+    static bool read_batch(
+        std::istream &is,
+        size_t batch_size,
+        std::vector<std::string> &lines,
+        std::vector<std::string_view> &codes,
+        std::vector<std::string_view> &texts,
+        std::vector<double> &weights
+    );
+
+    /**
+     * 批量训练，read 每次读取一批样本到 codes、texts 和 weights 中，没有样本时返回 false.
+     */
+    template<typename ReadBatch>
+    bool train_batches(ReadBatch read, Metrics &metrics);
+
+    template<typename ReadBatch>
+    bool evaluate_batches(ReadBatch read, Metrics &metrics, EvaluationReport *report = nullptr) const;
+
     void init_beams(std::vector<std::vector<Node>> &beams, size_t len) const
     {
         beams.clear();
@@ -203,27 +469,34 @@ private:
     }
 
     bool begin_decode(
-        const std::string &code,
-        const std::string &text,
+        std::string_view code,
+        std::string_view text,
         size_t beam_size,
         std::vector<std::vector<Node>> &beams,
         bool bos = true
     ) const;
 
     bool end_decode(
-        const std::string &code,
-        const std::string &text,
+        std::string_view code,
+        std::string_view text,
         size_t beam_size,
         std::vector<std::vector<Node>> &beams,
-        bool eos = true
+        bool eos = true,
+        SearchStats *stats = nullptr,
+        BeamIndex *index = nullptr
     ) const;
 
+    /**
+     * 扩展一个集束，index 不为空时在剪枝后为新集束建立按前驱的索引（训练时供 match 使用）.
+     */
     bool advance(
-        const std::string &code,
-        const std::string &text,
+        std::string_view code,
+        std::string_view text,
         size_t pos,
         size_t beam_size,
-        std::vector<std::vector<Node>> &beams
+        std::vector<std::vector<Node>> &beams,
+        SearchStats *stats = nullptr,
+        BeamIndex *index = nullptr
     ) const;
 
     /**
@@ -234,7 +507,7 @@ private:
      */
     bool fullfill_shift_constraint(
         Node &node,
-        const std::string &code,
+        std::string_view code,
         size_t pos
     ) const
     {
@@ -251,9 +524,9 @@ private:
      */
     bool fullfill_reduce_constraint(
         Node &node,
-        const std::string &code,
-        const std::string &text,
-        size_t pos
+        std::string_view /* code */,
+        std::string_view text,
+        size_t /* pos */
     ) const
     {
         assert(node.prev != nullptr);
@@ -268,13 +541,33 @@ private:
         ) == 0);
     }
 
-    void make_features(
-        Node &node,
-        const std::string &code,
-        size_t pos
-    ) const;
+    /**
+     * 计算节点的得分.
+     */
+    void compute_score(Node &node) const
+    {
+        // 因为是线性模型且特征是子路径局部特征的超集，从前一个节点取局部特征分数以加速计算
+        node.local_score = (node.prev != nullptr) ? node.prev->local_score : 0;
+        Features::local_score(model, node, node.local_score);
 
-    void topk(std::vector<Node> &beam, size_t beam_size) const;
+        // 再加上本节点（代表的路径）特有的全局特征
+        node.score = node.local_score;
+        Features::global_score(model, node, node.score);
+    }
+
+    /**
+     * 计算集束中全部节点的得分，需要计时时先提取全部节点的特征再计分，分别计时.
+     */
+    void compute_scores(std::vector<Node> &beam, SearchStats *stats) const;
+
+    /**
+     * 按各路径的梯度更新路径上的全部特征，rears 为一个样本各路径的最后一个节点.
+     *
+     * 同一特征的更新量先合并，每个样本只更新一次，见 FeatureSet::update
+     */
+    void update(const std::vector<Node> &rears, const std::vector<double> &deltas);
+
+    void topk(std::vector<Node> &beam, size_t beam_size, SearchStats *stats = nullptr) const;
 
     std::vector<std::vector<Node>> get_paths(
         const std::vector<std::vector<Node>> &beams,
@@ -331,40 +624,66 @@ private:
      * 因此需要当所有目标路径都掉出搜索候选以外才中止
      */
     size_t early_update(
-        const std::string &code,
+        std::string_view code,
         const std::vector<std::vector<Node>> &paths,
         std::vector<std::vector<Node>> &beams,
-        size_t &label
+        size_t &label,
+        SearchStats *stats
+    ) const;
+
+    /**
+     * 使用最大违例（max-violation）策略计算更新位置，参数和返回值同 early_update.
+     *
+     * 目标路径掉出集束后仍像 early_update 一样强制加回，继续搜索到最后，
+     * 在集束最高分和目标路径得分之差最大的位置更新；目标路径始终得分最高时在最后一步更新
+     */
+    size_t max_violation(
+        std::string_view code,
+        const std::vector<std::vector<Node>> &paths,
+        std::vector<std::vector<Node>> &beams,
+        size_t &label,
+        SearchStats *stats
     ) const;
 
     size_t early_update(
-        const std::string &code,
-        const std::string &text,
+        std::string_view code,
+        std::string_view text,
+        double weight,
         std::vector<std::vector<Node>> &beams,
         std::vector<double> &deltas,
         size_t &label,
-        double &prob
+        double &prob,
+        SearchStats *stats
     ) const;
 
     /**
      * 在集束中查找包含目标路径的节点，如果所有路径都不在集束中，向集束强制添加一个路径的节点.
      *
      * indeces 包含了上一步查找匹配到的节点索引，因此不用从头遍历路径，
-     * 只需要从上一步匹配的点向后查找就可以了
+     * 只需要从上一步匹配的点向后查找就可以了。
+     * index 是 advance 或 end_decode 生成集束时建立的索引，按 (前驱下标, 词) 查找节点，
+     * 每条路径每步只比较同一前驱的几个子节点
      */
     bool match(
         std::vector<std::vector<Node>> &beams,
         const std::vector<std::vector<Node>> &paths,
         size_t pos,
-        std::vector<size_t> &indeces
+        std::vector<size_t> &indeces,
+        const BeamIndex &index
     ) const;
 
     size_t beam_size;
     const Dictionary &dict;
     Model model;
     const Word bos_eos;     ///< 代表句子起始和结束的虚拟词，用于构造 n-gram
+    size_t _threads;
+    UpdateStrategy _strategy;
 };
 
+extern template class BasicDecoder<DefaultFeatureSet>;
+
+typedef BasicDecoder<DefaultFeatureSet> Decoder;
+
 }   // namespace ime
 
 #endif  // _DECODER_H_
@@ -0,0 +1,116 @@
+/**
+ * 取值范围小的数值特征.
+ */
+
+#ifndef _DENSE_H_
+#define _DENSE_H_
+
+#include <cstddef>
+#include <string>
+#include <atomic>
+#include <memory>
+
+#include "concurrent_map.h"
+
+
+namespace ime
+{
+
+/**
+ * 一个数值特征模板的权重，按取值直接索引，不需要格式化字符串和哈希.
+ *
+ * 权重支持并发更新。超出取值范围的特征不在这里保存，
+ * 由调用者退回到以特征键为键的稀疏权重表
+ */
+class DenseWeights
+{
+public:
+    DenseWeights(const std::string &name_ = "", size_t size_ = 0) :
+        _name(name_),
+        _size(size_),
+        weights(new std::atomic<double>[size_])
+    {
+        clear();
+    }
+
+    DenseWeights(const DenseWeights &other) :
+        _name(other._name),
+        _size(other._size),
+        weights(new std::atomic<double>[other._size])
+    {
+        for (size_t i = 0; i < _size; ++i)
+        {
+            weights[i].store(other.weights[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    DenseWeights(DenseWeights &&other) = default;
+
+    DenseWeights & operator = (DenseWeights &&other) = default;
+
+    const std::string & name() const
+    {
+        return _name;
+    }
+
+    /**
+     * 取值范围的上界，合法取值为 [0, size).
+     */
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool contains(size_t value) const
+    {
+        return value < _size;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < _size; ++i)
+        {
+            weights[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    double get(size_t value) const
+    {
+        return weights[value].load(std::memory_order_relaxed);
+    }
+
+    void set(size_t value, double weight)
+    {
+        weights[value].store(weight, std::memory_order_relaxed);
+    }
+
+    void add(size_t value, double delta)
+    {
+        atomic_add(weights[value], delta);
+    }
+
+    /**
+     * 遍历全部非零权重.
+     */
+    template<typename Function>
+    void for_each(Function f) const
+    {
+        for (size_t i = 0; i < _size; ++i)
+        {
+            auto weight = get(i);
+            if (weight != 0)
+            {
+                f(i, weight);
+            }
+        }
+    }
+
+private:
+    std::string _name;
+    size_t _size;
+    std::unique_ptr<std::atomic<double>[]> weights;
+};
+
+}   // namespace ime
+
+#endif  // _DENSE_H_
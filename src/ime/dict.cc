@@ -9,6 +9,7 @@
 
 #include "dict.h"
 #include "log.h"
+#include "trace.h"
 #include "common.h"
 
 
@@ -17,9 +18,14 @@ namespace ime
 
 bool Dictionary::load(std::istream &is)
 {
+    TRACE_SPAN("load");
     data.clear();
     _max_code_len = 0;
     _max_text_len = 0;
+    // 编号 0 保留给空文本，即句子起始和结束标识
+    texts.assign(1, "");
+    ids.clear();
+    ids.emplace("", 0);
 
     while (!is.eof())
     {
@@ -37,7 +43,13 @@ bool Dictionary::load(std::istream &is)
             && (text.length() <= text_len_limit)
         )
         {
-            Word word(code, text);
+            auto id = ids.emplace(text, texts.size());
+            if (id.second)
+            {
+                texts.push_back(text);
+            }
+
+            Word word(code, text, id.first->second);
             VERBOSE << "load word " << word << std::endl;
             data.emplace(code, std::move(word));
 
@@ -57,7 +69,8 @@ bool Dictionary::load(std::istream &is)
     }
 
     INFO << "loaded " << data.size() << " words, max code length = "
-        << _max_code_len << ", max text length = " << _max_text_len << std::endl;
+        << _max_code_len << ", max text length = " << _max_text_len
+        << ", " << texts.size() - 1 << " distinct texts" << std::endl;
     return true;
 }
 
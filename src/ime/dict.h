@@ -7,7 +7,10 @@
 
 #include <limits>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <map>
+#include <unordered_map>
 #include <fstream>
 #include <iostream>
 
@@ -29,7 +32,9 @@ public:
         text_len_limit(text_len_limit_),
         _max_code_len(0),
         _max_text_len(0),
-        data()
+        data(),
+        texts(),
+        ids()
     {
         load(fname);
     }
@@ -52,10 +57,35 @@ public:
         return _max_text_len;
     }
 
+    /**
+     * 词文本编号的上界，所有词的编号都小于该值.
+     */
+    size_t word_count() const
+    {
+        return texts.size();
+    }
+
+    const std::string & text(size_t id) const
+    {
+        assert(id < texts.size());
+        return texts[id];
+    }
+
+    /**
+     * 查找词文本的编号，词典中不存在的文本返回 unknown_id.
+     */
+    size_t id(const std::string &text) const
+    {
+        auto iter = ids.find(text);
+        return (iter != ids.cend()) ? iter->second : unknown_id;
+    }
+
+    static constexpr size_t unknown_id = std::numeric_limits<size_t>::max();
+
     void find(
-        const std::string &code,
-        std::multimap<std::string, Word>::const_iterator &begin,
-        std::multimap<std::string, Word>::const_iterator &end
+        std::string_view code,
+        std::multimap<std::string, Word, std::less<>>::const_iterator &begin,
+        std::multimap<std::string, Word, std::less<>>::const_iterator &end
     ) const
     {
         auto range = data.equal_range(code);
@@ -68,7 +98,9 @@ private:
     size_t text_len_limit;      ///< 最大词长限制
     size_t _max_code_len;       ///< 实际载入的最大编码长度
     size_t _max_text_len;       ///< 实际载入的最大词长
-    std::multimap<std::string, Word> data;
+    std::multimap<std::string, Word, std::less<>> data;
+    std::vector<std::string> texts;                 ///< 编号到词文本的映射
+    std::unordered_map<std::string, size_t> ids;    ///< 词文本到编号的映射
 };
 
 }   // namespace ime
@@ -1,127 +1,436 @@
 /**
- * 特征相关的数据结构.
+ * 特征模板.
+ *
+ * 每个特征模板是一个类型，给出编号、名字、权重的存放方式，
+ * 以及从节点提取特征取值的内联函数。解码器以模板列表（FeatureSet）为模板参数，
+ * 特征的提取和计分在编译期展开，没有列入的模板不产生任何开销
  */
 
 #ifndef _FEATURE_H_
 #define _FEATURE_H_
 
-#include <iterator>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iostream>
 
 #include "common.h"
+#include "dict.h"
+#include "bigram.h"
 
 
 namespace ime
 {
 
-class Features
+/**
+ * 特征模板权重的存放方式.
+ */
+enum class FeatureStorage
 {
-public:
-    class Iterator : public std::iterator<std::input_iterator_tag, Features>
+    DENSE,      ///< 按取值索引的数组，适合取值范围小的模板，超出范围的取值退回 SPARSE
+    BIGRAM,     ///< 按词编号对存放的 BigramTable，取值为 BigramTable::key
+    SPARSE      ///< 以特征键为键的哈希表
+};
+
+constexpr unsigned feature_value_bits = 56;
+constexpr uint64_t feature_value_mask = (static_cast<uint64_t>(1) << feature_value_bits) - 1;
+constexpr uint32_t max_feature_templates = 1u << (64 - feature_value_bits);
+
+/**
+ * 把模板编号和取值打包为 64 位的特征键，高 8 位为模板编号，低 56 位为取值.
+ */
+inline constexpr uint64_t feature_key(uint32_t tmpl, uint64_t value)
+{
+    return (static_cast<uint64_t>(tmpl) << feature_value_bits) | (value & feature_value_mask);
+}
+
+inline constexpr uint32_t feature_template(uint64_t key)
+{
+    return static_cast<uint32_t>(key >> feature_value_bits);
+}
+
+inline constexpr uint64_t feature_value(uint64_t key)
+{
+    return key & feature_value_mask;
+}
+
+/**
+ * 词的 unigram 特征，取值为词文本编号.
+ *
+ * 特征模板需要提供以下成员：
+ * - id：模板编号，同一个 FeatureSet 中不能重复
+ * - name：特征名前缀，保存的特征名为 "name:取值的文本形式"
+ * - global：是否全局特征，全局特征只在节点是路径的最后一个节点时生效
+ * - storage：权重的存放方式，DENSE 模板还需要提供取值范围 domain
+ * - extract：从节点提取取值，节点不含该特征时返回 false
+ * - format / parse：取值和文本之间的转换，用于模型的保存和载入
+ */
+struct UnigramTemplate
+{
+    static constexpr uint32_t id = 0;
+    static constexpr const char *name = "unigram";
+    static constexpr bool global = false;
+    static constexpr FeatureStorage storage = FeatureStorage::DENSE;
+
+    static size_t domain(const Dictionary &dict)
     {
-    public:
-        explicit Iterator(const Node *p = nullptr) : node(p), local(false)
+        return dict.word_count();
+    }
+
+    static bool extract(const Node &node, uint64_t &value)
+    {
+        if ((node.word == nullptr) || node.word->text.empty())
         {
-            if (node != nullptr)
-            {
-                _cur = node->global_features.cbegin();
-                _end = node->global_features.cend();
-                force_valid();
-            }
+            return false;
         }
 
-        void force_valid()
+        value = node.word->id;
+        return true;
+    }
+
+    static std::string format(uint64_t value, const Dictionary &dict)
+    {
+        return dict.text(value);
+    }
+
+    static bool parse(const std::string &text, const Dictionary &dict, uint64_t &value)
+    {
+        auto id = dict.id(text);
+        if (id == Dictionary::unknown_id)
         {
-            while ((_cur == _end) && (node != nullptr))
+            return false;
+        }
+
+        value = id;
+        return true;
+    }
+};
+
+/**
+ * 前一个词和当前词构成的 bigram 特征，包括句子起始和结束标识.
+ */
+struct BigramTemplate
+{
+    static constexpr uint32_t id = 1;
+    static constexpr const char *name = "bigram";
+    static constexpr bool global = false;
+    static constexpr FeatureStorage storage = FeatureStorage::BIGRAM;
+
+    static bool extract(const Node &node, uint64_t &value)
+    {
+        if ((node.word == nullptr) || (node.prev_word == nullptr))
+        {
+            return false;
+        }
+
+        value = BigramTable::key(node.prev_word->word->id, node.word->id);
+        return true;
+    }
+
+    static std::string format(uint64_t value, const Dictionary &dict)
+    {
+        return dict.text(BigramTable::prev_id(value)) + "_" + dict.text(BigramTable::cur_id(value));
+    }
+
+    static bool parse(const std::string &text, const Dictionary &dict, uint64_t &value)
+    {
+        // 词文本本身可能包含分隔符，逐个尝试，直到两边都是词典中的词
+        for (auto pos = text.find('_'); pos != std::string::npos; pos = text.find('_', pos + 1))
+        {
+            auto prev = dict.id(text.substr(0, pos));
+            auto cur = dict.id(text.substr(pos + 1));
+            if ((prev != Dictionary::unknown_id) && (cur != Dictionary::unknown_id))
             {
-                if (local == false)
-                {
-                    local = true;
-                    _cur = node->local_features.cbegin();
-                    _end = node->local_features.cend();
-                }
-                else
-                {
-                    node = node->prev;
-                    if (node != nullptr)
-                    {
-                        _cur = node->local_features.cbegin();
-                        _end = node->local_features.cend();
-                    }
-                }
+                value = BigramTable::key(prev, cur);
+                return true;
             }
         }
 
-        bool operator == (const Iterator &other) const
+        return false;
+    }
+};
+
+/**
+ * 路径末尾未匹配的编码长度.
+ */
+struct CodeLenTemplate
+{
+    static constexpr uint32_t id = 2;
+    static constexpr const char *name = "code_len";
+    static constexpr bool global = true;
+    static constexpr FeatureStorage storage = FeatureStorage::DENSE;
+
+    /**
+     * 移进的约束保证未匹配编码长度小于词典最大编码长度.
+     */
+    static size_t domain(const Dictionary &dict)
+    {
+        return dict.max_code_len() + 1;
+    }
+
+    static bool extract(const Node &node, uint64_t &value)
+    {
+        if (node.code_pos >= node.pos)
         {
-            return ((node == nullptr) && (other.node == nullptr))
-                || ((node == other.node) && (local == other.local) && (_cur == other._cur));
+            return false;
         }
 
-        bool operator != (const Iterator &other) const
+        value = node.pos - node.code_pos;
+        return true;
+    }
+
+    static std::string format(uint64_t value, const Dictionary &)
+    {
+        return std::to_string(value);
+    }
+
+    static bool parse(const std::string &text, const Dictionary &, uint64_t &value)
+    {
+        char *end;
+        auto v = strtoull(text.c_str(), &end, 10);
+        if (text.empty() || (*end != '\0') || (v > feature_value_mask))
         {
-            return !(*this == other);
+            return false;
         }
 
-        Iterator & operator ++ ()
+        value = v;
+        return true;
+    }
+};
+
+/**
+ * 编译期的特征模板列表，负责按模板逐个提取特征并计分、更新.
+ *
+ * 各函数对模板列表逐项展开，调用的都是模板的静态内联函数，
+ * Weights 为提供 weight<Template>、update<Template> 和 feature_name<Template> 的权重表（即 Model）
+ */
+template<typename... Templates>
+class FeatureSet
+{
+public:
+    static_assert(sizeof...(Templates) > 0, "feature set is empty");
+
+    static constexpr size_t size = sizeof...(Templates);
+
+    /**
+     * 向模型登记模板列表，模型据此分配权重表，并在保存和载入时转换特征名.
+     */
+    template<typename Weights>
+    static void register_templates(Weights &weights)
+    {
+        static_assert(valid_ids(), "feature template ids must be unique and less than max_feature_templates");
+        (weights.template register_template<Templates>(), ...);
+    }
+
+    /**
+     * 把节点的局部特征的得分累加到 score 上.
+     */
+    template<typename Weights>
+    static void local_score(const Weights &weights, const Node &node, double &score)
+    {
+        // 逗号折叠表达式从左到右求值，累加顺序和模板列表一致
+        (accumulate<Templates, false>(weights, node, score), ...);
+    }
+
+    /**
+     * 把节点作为路径末尾时的全局特征的得分累加到 score 上.
+     */
+    template<typename Weights>
+    static void global_score(const Weights &weights, const Node &node, double &score)
+    {
+        (accumulate<Templates, true>(weights, node, score), ...);
+    }
+
+    /**
+     * 从一个节点提取的各模板取值，found[i] 为第 i 个模板是否有取值.
+     *
+     * 用于分别统计特征提取和计分的耗时（见 EvaluationReport），
+     * 先 extract 再 score 和直接 local_score / global_score 的结果逐位相同
+     */
+    struct Values
+    {
+        uint64_t value[size];
+        bool found[size];
+    };
+
+    /**
+     * 提取节点的局部特征（global 为 false）或全局特征（global 为 true）的取值.
+     */
+    template<bool global>
+    static void extract(const Node &node, Values &values)
+    {
+        extract_values<global>(node, values, std::index_sequence_for<Templates...>());
+    }
+
+    /**
+     * 把 extract 提取的特征的得分累加到 score 上.
+     */
+    template<typename Weights>
+    static void score(const Weights &weights, const Values &values, double &score)
+    {
+        score_values(weights, values, score, std::index_sequence_for<Templates...>());
+    }
+
+    /**
+     * 一个特征的更新量，index 为模板在列表中的位置.
+     */
+    struct Update
+    {
+        uint32_t index;
+        uint64_t value;
+        double delta;
+    };
+
+    /**
+     * 把以 node 结尾的路径上全部特征的更新量追加到 updates，由 update 合并后写入.
+     */
+    static void collect(const Node &node, double delta, std::vector<Update> &updates)
+    {
+        for (auto p = &node; p != nullptr; p = p->prev)
         {
-            ++_cur;
-            force_valid();
-            return *this;
+            collect_values<false>(*p, delta, updates);
         }
+        collect_values<true>(node, delta, updates);
+    }
 
-        Iterator operator ++ (int)
+    /**
+     * 合并 updates 中同一特征的更新量后写入权重表，会打乱 updates 的顺序.
+     *
+     * 集束中的路径共享前缀，逐条路径更新时前缀上的特征每条路径更新一次，
+     * 准入计数（见 Model::admit）也随之按集束大小成倍累计。合并后每个特征每个样本只更新一次，
+     * 所有路径共有的前缀的更新量正负抵消，不再写入
+     */
+    template<typename Weights>
+    static void update(Weights &weights, std::vector<Update> &updates)
+    {
+        std::sort(updates.begin(), updates.end(), [](const Update &a, const Update &b)
         {
-            auto old = *this;
-            _cur++;
-            force_valid();
-            return old;
-        }
+            return (a.index < b.index) || ((a.index == b.index) && (a.value < b.value));
+        });
 
-        const std::pair<std::string, double> & operator * () const
+        for (size_t i = 0; i < updates.size(); )
         {
-            return *_cur;
+            auto &update = updates[i];
+            auto delta = update.delta;
+            for (++i; (i < updates.size()) && (updates[i].index == update.index) && (updates[i].value == update.value); ++i)
+            {
+                delta += updates[i].delta;
+            }
+
+            if (std::abs(delta) > cancelled_delta)
+            {
+                update_value(weights, update.index, update.value, delta, std::index_sequence_for<Templates...>());
+            }
         }
+    }
 
-        const std::pair<std::string, double> * operator -> () const
+    /**
+     * 输出以 node 结尾的路径上各特征的权重，用于调试.
+     */
+    template<typename Weights>
+    static std::ostream & output(std::ostream &os, const Weights &weights, const Node &node)
+    {
+        for (auto p = &node; p != nullptr; p = p->prev)
         {
-            return &*_cur;
+            (output_template<Templates, false>(os, weights, *p), ...);
         }
+        (output_template<Templates, true>(os, weights, node), ...);
+        return os;
+    }
 
-    private:
-        const Node *node;
-        bool local;
-        std::vector<std::pair<std::string, double>>::const_iterator _cur;
-        std::vector<std::pair<std::string, double>>::const_iterator _end;
-    };
+private:
+    /// 合并后绝对值不超过该值的更新量视为正负抵消（各路径的更新量之和为 0，只剩舍入误差）
+    static constexpr double cancelled_delta = 1e-12;
 
-    typedef Iterator const_reverse_iterator;
+    static constexpr bool valid_ids()
+    {
+        constexpr uint32_t ids[] = {Templates::id...};
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (ids[i] >= max_feature_templates)
+            {
+                return false;
+            }
+            for (size_t j = 0; j < i; ++j)
+            {
+                if (ids[i] == ids[j])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
 
-    explicit Features(const Node *rear_) : rear(rear_) {}
+    template<typename Template, bool global, typename Weights>
+    static void accumulate(const Weights &weights, const Node &node, double &score)
+    {
+        if constexpr (Template::global == global)
+        {
+            uint64_t value;
+            if (Template::extract(node, value))
+            {
+                score += weights.template weight<Template>(value);
+            }
+        }
+    }
 
-    Features(const Node &rear_) : rear(&rear_) {}
+    template<bool global, size_t... I>
+    static void extract_values(const Node &node, Values &values, std::index_sequence<I...>)
+    {
+        ((values.found[I] = (Templates::global == global) && Templates::extract(node, values.value[I])), ...);
+    }
 
-    const_reverse_iterator begin() const
+    template<typename Weights, size_t... I>
+    static void score_values(const Weights &weights, const Values &values, double &score, std::index_sequence<I...>)
     {
-        return Iterator(rear);
+        ((values.found[I] ? (void)(score += weights.template weight<Templates>(values.value[I])) : (void)0), ...);
     }
 
-    const_reverse_iterator end() const
+    template<bool global>
+    static void collect_values(const Node &node, double delta, std::vector<Update> &updates)
     {
-        return Iterator();
+        Values values;
+        extract_values<global>(node, values, std::index_sequence_for<Templates...>());
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (values.found[i])
+            {
+                updates.push_back({static_cast<uint32_t>(i), values.value[i], delta});
+            }
+        }
     }
 
-private:
-    const Node *rear;
-};
+    template<typename Weights, size_t... I>
+    static void update_value(Weights &weights, uint32_t index, uint64_t value, double delta, std::index_sequence<I...>)
+    {
+        ((index == I ? (void)weights.template update<Templates>(value, delta) : (void)0), ...);
+    }
 
-inline std::ostream & operator << (std::ostream &os, const Features &features)
-{
-    for (auto &f : features)
+    template<typename Template, bool global, typename Weights>
+    static void output_template(std::ostream &os, const Weights &weights, const Node &node)
     {
-        os << f.first << ':' << f.second <<',';
+        if constexpr (Template::global == global)
+        {
+            uint64_t value;
+            if (Template::extract(node, value))
+            {
+                os << weights.template feature_name<Template>(value)
+                    << ":1 * " << weights.template weight<Template>(value) << " + ";
+            }
+        }
     }
-    return os;
-}
+};
+
+/**
+ * 默认的特征模板列表.
+ */
+typedef FeatureSet<UnigramTemplate, BigramTemplate, CodeLenTemplate> DefaultFeatureSet;
 
 }   // namespace ime
 
@@ -0,0 +1,81 @@
+/**
+ *
+ */
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "flat_map.h"
+
+
+namespace ime
+{
+
+template<typename Key>
+void BasicFlatWeightMap<Key>::build(const std::vector<std::pair<Key, double>> &weights)
+{
+    clear();
+
+    // 负载因子不超过 7/8，组数取 2 的幂
+    size_t groups = 1;
+    while (groups * group_size * 7 < weights.size() * 8)
+    {
+        groups *= 2;
+    }
+
+    group_mask = groups - 1;
+    ctrl.assign(groups * group_size, empty_ctrl);
+    slots.resize(groups * group_size);
+
+    size_t key_bytes = 0;
+    if constexpr (!integer)
+    {
+        for (auto &i : weights)
+        {
+            key_bytes += i.first.length();
+        }
+        keys.reserve(key_bytes);
+    }
+
+    for (auto &i : weights)
+    {
+        auto h = hash(i.first);
+        auto group = (h >> 7) & group_mask;
+        for (size_t probe = 1; ; ++probe)
+        {
+            auto base = group * group_size;
+            auto mask = match(&ctrl[base], empty_ctrl);
+            if (mask != 0)
+            {
+                auto index = base + __builtin_ctz(mask);
+                ctrl[index] = static_cast<int8_t>(h & 0x7f);
+                if constexpr (integer)
+                {
+                    slots[index] = {i.first, i.second};
+                }
+                else
+                {
+                    slots[index] = {
+                        h,
+                        static_cast<uint32_t>(keys.length()),
+                        static_cast<uint32_t>(i.first.length()),
+                        i.second
+                    };
+                    keys.append(i.first);
+                }
+                break;
+            }
+
+            group = (group + probe) & group_mask;
+        }
+    }
+
+    _size = weights.size();
+    assert(keys.length() == key_bytes);
+}
+
+template void FlatWeightMap::build(const std::vector<std::pair<std::string, double>> &weights);
+template void FlatIntegerWeightMap::build(const std::vector<std::pair<uint64_t, double>> &weights);
+
+}   // namespace ime
@@ -0,0 +1,235 @@
+/**
+ * 只读的扁平权重哈希表.
+ */
+
+#ifndef _FLAT_MAP_H_
+#define _FLAT_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+#include "common.h"
+
+
+namespace ime
+{
+
+/**
+ * 开放寻址的只读权重表，仿照 Swiss table 的组探测方式.
+ *
+ * 槽位按 16 个一组，每个槽位对应一个控制字节：空槽为 empty_ctrl，
+ * 否则为键哈希值的低 7 位。查找时用 SIMD 一次比较一组控制字节，
+ * 只有控制字节匹配的槽位才需要比较键。
+ * Key 为 std::string 时键统一存放在一块连续内存中，槽位保存其偏移、长度和预先计算的哈希值；
+ * Key 为整数时键直接存放在槽位中，哈希值由 mix64 现算，比较键只是一次整数比较。
+ * 整数键的槽位不保存预先计算的哈希值：比较哈希值并不比直接比较键便宜，
+ * 现算 mix64 只需几次乘法和移位，省下的 8 字节让槽位缩小到 16 字节，一条缓存行放得下 4 个槽位。
+ * 整个表只有两到三块连续内存，没有逐个特征的堆分配。
+ * 只支持整体构造，用于预测时的只读路径
+ */
+template<typename Key>
+class BasicFlatWeightMap
+{
+public:
+    static constexpr bool integer = std::is_integral<Key>::value;
+
+    BasicFlatWeightMap() : ctrl(), slots(), keys(), _size(0), group_mask(0) {}
+
+    void build(const std::vector<std::pair<Key, double>> &weights);
+
+    void clear()
+    {
+        std::vector<int8_t>().swap(ctrl);
+        std::vector<Slot>().swap(slots);
+        std::string().swap(keys);
+        _size = 0;
+        group_mask = 0;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    /**
+     * 占用的内存字节数.
+     */
+    size_t memory() const
+    {
+        return ctrl.capacity() + slots.capacity() * sizeof(Slot) + keys.capacity();
+    }
+
+    static size_t hash(const char *key, size_t length)
+    {
+        return std::hash<std::string_view>()(std::string_view(key, length));
+    }
+
+    static size_t hash(const std::string &key)
+    {
+        return hash(key.data(), key.length());
+    }
+
+    static size_t hash(uint64_t key)
+    {
+        return static_cast<size_t>(mix64(key));
+    }
+
+    const double * find(const Key &key) const
+    {
+        if constexpr (integer)
+        {
+            auto h = hash(static_cast<uint64_t>(key));
+            return probe(h, [&](const Slot &slot) { return slot.key == key; });
+        }
+        else
+        {
+            return find(key.data(), key.length(), hash(key));
+        }
+    }
+
+    /**
+     * 使用调用者预先计算的哈希值查找字符串键，键不存在返回 nullptr.
+     */
+    const double * find(const char *key, size_t length, size_t h) const
+    {
+        static_assert(!integer, "string lookup on an integer keyed map");
+        return probe(h, [&](const Slot &slot)
+        {
+            return (slot.hash == h)
+                && (slot.length == length)
+                && (memcmp(keys.data() + slot.offset, key, length) == 0);
+        });
+    }
+
+    double weight(const Key &key) const
+    {
+        auto p = find(key);
+        return (p != nullptr) ? *p : 0;
+    }
+
+    template<typename Function>
+    void for_each(Function f) const
+    {
+        for (size_t i = 0; i < slots.size(); ++i)
+        {
+            if (ctrl[i] != empty_ctrl)
+            {
+                if constexpr (integer)
+                {
+                    f(slots[i].key, slots[i].weight);
+                }
+                else
+                {
+                    f(std::string(keys, slots[i].offset, slots[i].length), slots[i].weight);
+                }
+            }
+        }
+    }
+
+private:
+    struct StringSlot
+    {
+        uint64_t hash;
+        uint32_t offset;
+        uint32_t length;
+        double weight;
+    };
+
+    struct IntegerSlot
+    {
+        Key key;
+        double weight;
+    };
+
+    typedef typename std::conditional<integer, IntegerSlot, StringSlot>::type Slot;
+
+    static constexpr size_t group_size = 16;
+    static constexpr int8_t empty_ctrl = static_cast<int8_t>(0x80);
+
+    /**
+     * 按哈希值 h 的探测序列查找第一个满足 equal 的槽位.
+     */
+    template<typename Equal>
+    const double * probe(size_t h, Equal equal) const
+    {
+        if (_size == 0)
+        {
+            return nullptr;
+        }
+
+        auto tag = static_cast<int8_t>(h & 0x7f);
+        auto group = (h >> 7) & group_mask;
+        for (size_t probe = 1; ; ++probe)
+        {
+            auto base = group * group_size;
+            for (auto mask = match(&ctrl[base], tag); mask != 0; mask &= mask - 1)
+            {
+                auto &slot = slots[base + __builtin_ctz(mask)];
+                if (equal(slot))
+                {
+                    return &slot.weight;
+                }
+            }
+
+            // 组内有空槽说明键不可能在后面的组中
+            if (match(&ctrl[base], empty_ctrl) != 0)
+            {
+                return nullptr;
+            }
+
+            // 三角数探测，组数为 2 的幂时能遍历所有组
+            group = (group + probe) & group_mask;
+        }
+    }
+
+    /**
+     * 返回一组控制字节中等于 b 的位掩码.
+     */
+    static uint32_t match(const int8_t *group, int8_t b)
+    {
+#ifdef __SSE2__
+        auto c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(b))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < group_size; ++i)
+        {
+            if (group[i] == b)
+            {
+                mask |= 1u << i;
+            }
+        }
+        return mask;
+#endif  // __SSE2__
+    }
+
+    std::vector<int8_t> ctrl;
+    std::vector<Slot> slots;
+    std::string keys;       ///< 字符串键首尾相连存放，整数键时为空
+    size_t _size;
+    size_t group_mask;
+};
+
+typedef BasicFlatWeightMap<std::string> FlatWeightMap;
+typedef BasicFlatWeightMap<uint64_t> FlatIntegerWeightMap;
+
+}   // namespace ime
+
+#endif  // _FLAT_MAP_H_
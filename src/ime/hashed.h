@@ -0,0 +1,127 @@
+/**
+ * 定长的哈希特征权重表.
+ */
+
+#ifndef _HASHED_H_
+#define _HASHED_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+#include "dense.h"
+
+
+namespace ime
+{
+
+/**
+ * 把 64 位特征键哈希到 2^bits 个槽位的权重数组（hashing trick）.
+ *
+ * 内存只由 bits 决定，与语料规模无关，查找只是一次数组访问。
+ * 哈希值的最高位决定特征的符号，冲突的特征以相反符号落在同一槽位时相互抵消，
+ * 期望上不引入偏差。不保存特征键，冲突的特征无法区分
+ */
+class HashedWeights
+{
+public:
+    HashedWeights() : _bits(0), mask(0), slots() {}
+
+    /**
+     * 分配 2^bits 个槽位并清零.
+     */
+    void reset(size_t bits)
+    {
+        _bits = bits;
+        mask = (static_cast<uint64_t>(1) << bits) - 1;
+        slots = DenseWeights("hashed", static_cast<size_t>(1) << bits);
+    }
+
+    void clear()
+    {
+        _bits = 0;
+        mask = 0;
+        slots = DenseWeights();
+    }
+
+    bool empty() const
+    {
+        return slots.size() == 0;
+    }
+
+    size_t bits() const
+    {
+        return _bits;
+    }
+
+    size_t size() const
+    {
+        return slots.size();
+    }
+
+    size_t memory() const
+    {
+        return slots.size() * sizeof(double);
+    }
+
+    size_t slot(uint64_t key) const
+    {
+        return static_cast<size_t>(mix64(key) & mask);
+    }
+
+    double get(uint64_t key) const
+    {
+        auto h = mix64(key);
+        auto weight = slots.get(static_cast<size_t>(h & mask));
+        return negative(h) ? -weight : weight;
+    }
+
+    /**
+     * 带符号地累加到特征所在槽位，可以由多个线程同时调用.
+     */
+    void add(uint64_t key, double delta)
+    {
+        auto h = mix64(key);
+        slots.add(static_cast<size_t>(h & mask), negative(h) ? -delta : delta);
+    }
+
+    /**
+     * 按槽位读写原始权重，用于模型的保存和载入.
+     */
+    double at(size_t slot) const
+    {
+        return slots.get(slot);
+    }
+
+    void set(size_t slot, double weight)
+    {
+        slots.set(slot, weight);
+    }
+
+    /**
+     * 遍历全部非零槽位.
+     */
+    template<typename Function>
+    void for_each(Function f) const
+    {
+        slots.for_each(f);
+    }
+
+private:
+    /**
+     * 槽位取自哈希值的低位，符号取最高位，两者相互独立.
+     */
+    static bool negative(uint64_t h)
+    {
+        return (h >> 63) != 0;
+    }
+
+    size_t _bits;
+    uint64_t mask;
+    DenseWeights slots;
+};
+
+}   // namespace ime
+
+#endif  // _HASHED_H_
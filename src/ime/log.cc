@@ -0,0 +1,280 @@
+/**
+ *
+ */
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <iostream>
+
+#include <pthread.h>
+
+#include "log.h"
+
+
+namespace ime
+{
+
+namespace
+{
+
+/**
+ * 一个线程的消息队列，只由所属线程写入，由持有 State::mutex 的线程读出.
+ */
+struct Queue
+{
+    static constexpr size_t capacity = 1024;
+
+    std::string slots[capacity];
+    std::atomic<size_t> head{0};        ///< 下一条要输出的消息
+    std::atomic<size_t> tail{0};        ///< 下一条消息写入的位置
+};
+
+struct State
+{
+    std::mutex mutex;                   ///< 保护队列列表、后台线程的启停和输出
+    std::condition_variable wakeup;
+    std::vector<std::shared_ptr<Queue>> queues;
+    std::thread *flusher = nullptr;
+    std::atomic<bool> running{false};
+    bool stopping = false;
+    std::atomic<bool> closed{false};    ///< 进程退出时后台线程已结束，之后同步输出
+    std::string out;
+};
+
+/**
+ * 全局状态，不析构，退出过程中其他静态对象的析构函数仍然可以写日志.
+ */
+State & state()
+{
+    static auto s = new State();
+    return *s;
+}
+
+/**
+ * 一个线程的队列，线程退出时输出积压的消息并把队列从列表中移除.
+ */
+struct QueueOwner
+{
+    std::shared_ptr<Queue> queue;
+
+    ~QueueOwner();
+};
+
+thread_local QueueOwner local_owner;
+thread_local Queue *local_queue = nullptr;
+thread_local bool thread_exiting = false;   ///< 平凡类型，local_owner 析构后仍可以读取
+
+/**
+ * 取出一个队列中的消息追加到 out，调用时持有 mutex.
+ */
+void drain(Queue &q, std::string &out)
+{
+    auto head = q.head.load(std::memory_order_relaxed);
+    auto tail = q.tail.load(std::memory_order_acquire);
+    for (; head != tail; ++head)
+    {
+        auto &slot = q.slots[head % Queue::capacity];
+        out += slot;
+        slot.clear();
+    }
+    q.head.store(head, std::memory_order_release);
+}
+
+/**
+ * 输出已取出的消息，调用时持有 mutex.
+ */
+void write_out(State &s)
+{
+    if (!s.out.empty())
+    {
+        std::cerr.write(s.out.data(), s.out.size());
+        std::cerr.flush();
+        s.out.clear();
+    }
+}
+
+QueueOwner::~QueueOwner()
+{
+    thread_exiting = true;
+    if (!queue)
+    {
+        return;
+    }
+
+    auto &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    drain(*queue, s.out);
+    write_out(s);
+    s.queues.erase(std::remove(s.queues.begin(), s.queues.end(), queue), s.queues.end());
+    local_queue = nullptr;
+}
+
+/**
+ * 输出全部队列中的消息，调用时持有 mutex.
+ */
+void drain_all(State &s)
+{
+    for (auto &q : s.queues)
+    {
+        drain(*q, s.out);
+    }
+
+    write_out(s);
+}
+
+void run(State &s)
+{
+    std::unique_lock<std::mutex> lock(s.mutex);
+    while (!s.stopping)
+    {
+        drain_all(s);
+        s.wakeup.wait_for(lock, std::chrono::milliseconds(5));
+    }
+    drain_all(s);
+}
+
+void shutdown()
+{
+    auto &s = state();
+    std::thread *flusher;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.stopping = true;
+        s.closed.store(true);
+        flusher = s.flusher;
+        s.flusher = nullptr;
+    }
+    s.wakeup.notify_all();
+
+    if (flusher != nullptr)
+    {
+        flusher->join();
+        delete flusher;
+    }
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    drain_all(s);
+}
+
+/**
+ * fork 前输出积压的消息并持有锁，子进程中没有后台线程，重置后在下一次写日志时重新启动.
+ */
+void prepare_fork()
+{
+    auto &s = state();
+    s.mutex.lock();
+    drain_all(s);
+}
+
+void parent_after_fork()
+{
+    state().mutex.unlock();
+}
+
+void child_after_fork()
+{
+    auto &s = state();
+    // 后台线程不在子进程中，它的 std::thread 对象不能 join 也不能析构，只能丢弃
+    s.flusher = nullptr;
+    s.running.store(false);
+    // 其他线程也不在子进程中，它们的队列不会再有消息，只保留 fork 的线程的队列
+    s.queues.erase(
+        std::remove_if(
+            s.queues.begin(),
+            s.queues.end(),
+            [](const std::shared_ptr<Queue> &q) { return q.get() != local_queue; }
+        ),
+        s.queues.end()
+    );
+    for (auto &q : s.queues)
+    {
+        q->head.store(q->tail.load());
+    }
+    s.mutex.unlock();
+}
+
+/**
+ * 启动后台线程，调用时持有 mutex.
+ */
+void start(State &s)
+{
+    static bool registered = false;
+    if (!registered)
+    {
+        std::atexit(shutdown);
+        pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+        registered = true;
+    }
+
+    if (!s.running.load() && !s.closed.load())
+    {
+        s.stopping = false;
+        s.flusher = new std::thread(run, std::ref(s));
+        s.running.store(true);
+    }
+}
+
+}   // namespace
+
+void Logger::write(std::string &&message)
+{
+    auto &s = state();
+    // 线程退出过程中（其他 thread_local 对象的析构函数）不再创建队列，直接同步输出，
+    // 队列还在时先输出其中积压的消息，保持同一线程的顺序
+    if (s.closed.load(std::memory_order_relaxed) || thread_exiting)
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (local_queue != nullptr)
+        {
+            drain(*local_queue, s.out);
+        }
+        s.out += message;
+        write_out(s);
+        return;
+    }
+
+    if ((local_queue == nullptr) || !s.running.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (local_queue == nullptr)
+        {
+            local_owner.queue = std::make_shared<Queue>();
+            s.queues.push_back(local_owner.queue);
+            local_queue = local_owner.queue.get();
+        }
+        start(s);
+    }
+
+    auto &q = *local_queue;
+    auto tail = q.tail.load(std::memory_order_relaxed);
+    if (tail - q.head.load(std::memory_order_acquire) >= Queue::capacity)
+    {
+        // 队列已满，先输出这个线程积压的消息再同步输出，保持同一线程的顺序
+        std::lock_guard<std::mutex> lock(s.mutex);
+        drain(q, s.out);
+        s.out += message;
+        std::cerr.write(s.out.data(), s.out.size());
+        s.out.clear();
+        return;
+    }
+
+    q.slots[tail % Queue::capacity] = std::move(message);
+    q.tail.store(tail + 1, std::memory_order_release);
+}
+
+void Logger::flush()
+{
+    auto &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    drain_all(s);
+}
+
+}   // namespace ime
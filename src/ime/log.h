@@ -1,10 +1,16 @@
 /**
  * 简单的日志系统.
+ *
+ * 日志宏的用法和直接写 std::cerr 相同（INFO << ... << std::endl），
+ * 一条语句输出的内容先写入临时的缓冲区，语句结束时作为一条完整的消息交给 Logger，
+ * 由后台线程写入 std::cerr，多个线程的日志不会交错，写日志的线程也不等待输出
  */
 
 #ifndef _LOG_H_
 #define _LOG_H_
 
+#include <string>
+#include <sstream>
 #include <iostream>
 
 
@@ -22,7 +28,63 @@
 #endif  // NDEBUG
 #endif  // LOG_LEVEL
 
-#define LOG(level)  if ((level) >= LOG_LEVEL) std::cerr
+
+namespace ime
+{
+
+/**
+ * 异步日志.
+ *
+ * 每个线程有自己的单生产者单消费者环形队列，写入时不加锁；
+ * 后台线程定期取出各队列的消息写入 std::cerr，同一线程的消息保持顺序。
+ * 队列满时直接同步输出，不丢弃消息。线程退出时输出它积压的消息并移除它的队列，
+ * 进程退出和 fork 前会输出全部积压的消息，fork 出的子进程在第一次写日志时启动自己的后台线程
+ */
+class Logger
+{
+public:
+    /**
+     * 提交一条完整的消息.
+     */
+    static void write(std::string &&message);
+
+    /**
+     * 输出全部已提交的消息后返回.
+     */
+    static void flush();
+};
+
+/**
+ * 一条日志语句的缓冲区，析构时把内容提交给 Logger.
+ */
+class LogLine
+{
+public:
+    LogLine() : buffer() {}
+
+    LogLine(const LogLine &) = delete;
+
+    LogLine & operator = (const LogLine &) = delete;
+
+    ~LogLine()
+    {
+        Logger::write(buffer.str());
+    }
+
+    std::ostream & stream()
+    {
+        return buffer;
+    }
+
+private:
+    std::ostringstream buffer;
+};
+
+}   // namespace ime
+
+// 级别在编译期确定，低于 LOG_LEVEL 的语句被丢弃，其中的参数不会求值；
+// 写成 if-else 的形式，宏后面再跟 else 也不会和调用处的 if 错误配对
+#define LOG(level)  if constexpr (!((level) >= LOG_LEVEL)) {} else ::ime::LogLine().stream()
 #define VERBOSE LOG(LOG_VERBOSE) << "[V] " << __FILE__ << ':' << __FUNCTION__ << ':' << __LINE__ << ": "
 #define DEBUG   LOG(LOG_DEBUG) << "[D] " << __FILE__ << ':' << __FUNCTION__ << ':' << __LINE__ << ": "
 #define INFO    LOG(LOG_INFO) << "[I] "
@@ -0,0 +1,280 @@
+/**
+ *
+ */
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <algorithm>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "mixing.h"
+#include "log.h"
+
+
+namespace ime
+{
+
+namespace
+{
+
+typedef ParameterMixer::Parameters Parameters;
+
+/**
+ * 按特征键合并两个有序列表，缺少的键按 0 计，f(键, a 中的权重, b 中的权重).
+ */
+template<typename Function>
+void merge(const Parameters &a, const Parameters &b, Function f)
+{
+    size_t i = 0;
+    size_t j = 0;
+    while ((i < a.size()) || (j < b.size()))
+    {
+        if ((j == b.size()) || ((i < a.size()) && (a[i].first < b[j].first)))
+        {
+            f(a[i].first, a[i].second, 0.0);
+            ++i;
+        }
+        else if ((i == a.size()) || (b[j].first < a[i].first))
+        {
+            f(b[j].first, 0.0, b[j].second);
+            ++j;
+        }
+        else
+        {
+            f(a[i].first, a[i].second, b[j].second);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+bool write_all(int fd, const void *data, size_t size)
+{
+    auto p = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        // 对端已退出时返回错误，而不是收到 SIGPIPE
+        auto n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if ((n < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        else if (n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *data, size_t size)
+{
+    auto p = static_cast<char *>(data);
+    while (size > 0)
+    {
+        auto n = ::read(fd, p, size);
+        if ((n < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        else if (n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+}   // namespace
+
+ParameterMixer::~ParameterMixer()
+{
+    for (auto fd : peers)
+    {
+        close(fd);
+    }
+
+    // 工作进程在下一次混合时读到 EOF 后退出
+    for (auto pid : pids)
+    {
+        int status;
+        while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR));
+    }
+}
+
+std::unique_ptr<ParameterMixer> ParameterMixer::spawn(size_t workers, size_t &index)
+{
+    assert(workers > 0);
+
+    std::vector<int> peers;
+    std::vector<pid_t> pids;
+
+    // fork 会复制尚未输出的缓冲区
+    std::cout.flush();
+    Logger::flush();
+
+    for (size_t i = 0; i < workers; ++i)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            ERROR << "cannot create socket pair" << std::endl;
+            // 析构时关闭已创建的套接字并等待已启动的工作进程退出
+            ParameterMixer partial(std::move(peers), std::move(pids));
+            return nullptr;
+        }
+
+        auto pid = fork();
+        if (pid < 0)
+        {
+            ERROR << "cannot fork worker " << i << std::endl;
+            close(fds[0]);
+            close(fds[1]);
+            ParameterMixer partial(std::move(peers), std::move(pids));
+            return nullptr;
+        }
+        else if (pid == 0)
+        {
+            // 工作进程只保留和协调进程之间的套接字
+            for (auto fd : peers)
+            {
+                close(fd);
+            }
+            close(fds[0]);
+
+            index = i;
+            return std::unique_ptr<ParameterMixer>(new ParameterMixer({fds[1]}));
+        }
+
+        close(fds[1]);
+        peers.push_back(fds[0]);
+        pids.push_back(pid);
+    }
+
+    INFO << "spawned " << workers << " training workers" << std::endl;
+    index = workers;
+    return std::unique_ptr<ParameterMixer>(new ParameterMixer(std::move(peers), std::move(pids)));
+}
+
+bool ParameterMixer::mix(Model &model)
+{
+    Parameters mixed;
+    if (coordinator())
+    {
+        // 按工作进程编号的顺序累加，结果和进程的调度无关
+        for (auto fd : peers)
+        {
+            Parameters delta;
+            if (!receive(fd, delta))
+            {
+                ERROR << "failed to receive parameters from worker" << std::endl;
+                return false;
+            }
+
+            Parameters sum;
+            sum.reserve(std::max(mixed.size(), delta.size()));
+            merge(mixed, delta, [&](uint64_t key, double a, double b)
+            {
+                sum.emplace_back(key, a + b);
+            });
+            mixed.swap(sum);
+        }
+
+        for (auto &i : mixed)
+        {
+            i.second /= peers.size();
+        }
+
+        for (auto fd : peers)
+        {
+            if (!send(fd, mixed))
+            {
+                ERROR << "failed to send parameters to worker" << std::endl;
+                return false;
+            }
+        }
+    }
+    else
+    {
+        Parameters delta;
+        merge(model.parameters(), base, [&](uint64_t key, double current, double last)
+        {
+            if (current != last)
+            {
+                delta.emplace_back(key, current - last);
+            }
+        });
+
+        if (!send(peers.front(), delta) || !receive(peers.front(), mixed))
+        {
+            return false;
+        }
+    }
+
+    // 混合后的权重为上次混合时的权重加上平均变化，只设置有变化的特征
+    Parameters updates;
+    Parameters next;
+    updates.reserve(mixed.size());
+    next.reserve(base.size() + mixed.size());
+    size_t i = 0;
+    for (auto &m : mixed)
+    {
+        for (; (i < base.size()) && (base[i].first < m.first); ++i)
+        {
+            next.push_back(base[i]);
+        }
+
+        double last = 0;
+        if ((i < base.size()) && (base[i].first == m.first))
+        {
+            last = base[i].second;
+            ++i;
+        }
+
+        next.emplace_back(m.first, last + m.second);
+        updates.push_back(next.back());
+    }
+    next.insert(next.end(), base.begin() + i, base.end());
+
+    model.assign(updates);
+    base.swap(next);
+
+    DEBUG << "mixed " << updates.size() << " parameters" << std::endl;
+    return true;
+}
+
+bool ParameterMixer::send(int fd, const Parameters &parameters)
+{
+    uint64_t count = parameters.size();
+    return write_all(fd, &count, sizeof(count))
+        && write_all(fd, parameters.data(), parameters.size() * sizeof(Parameters::value_type));
+}
+
+bool ParameterMixer::receive(int fd, Parameters &parameters)
+{
+    uint64_t count = 0;
+    if (!read_all(fd, &count, sizeof(count)))
+    {
+        return false;
+    }
+
+    parameters.resize(count);
+    return read_all(fd, parameters.data(), parameters.size() * sizeof(Parameters::value_type));
+}
+
+}   // namespace ime
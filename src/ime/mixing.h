@@ -0,0 +1,90 @@
+/**
+ * 多进程训练的参数混合.
+ */
+
+#ifndef _MIXING_H_
+#define _MIXING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <memory>
+
+#include <sys/types.h>
+
+#include "model.h"
+
+
+namespace ime
+{
+
+/**
+ * 迭代参数混合（iterative parameter mixing），用于单机多进程的数据并行训练.
+ *
+ * 协调进程 fork 出若干工作进程，各自通过一对 Unix 套接字和协调进程通信。
+ * 每次混合时，工作进程把上次混合以来的权重变化发给协调进程，
+ * 协调进程求平均后发回，各进程都把模型设置为上次混合时的权重加上平均变化。
+ * 所有进程从同样的权重出发、按同样的顺序计算，混合后的权重逐位相同。
+ * 通信只经过套接字，以后换成跨机器的连接即可扩展到多机
+ */
+class ParameterMixer
+{
+public:
+    typedef std::vector<std::pair<uint64_t, double>> Parameters;
+
+    ParameterMixer(const ParameterMixer &) = delete;
+
+    ParameterMixer & operator = (const ParameterMixer &) = delete;
+
+    /**
+     * 协调进程关闭全部套接字并等待工作进程退出.
+     */
+    ~ParameterMixer();
+
+    /**
+     * fork 出 workers 个工作进程，在协调进程中 index 为 workers，在工作进程中为工作进程的编号.
+     *
+     * 必须在创建任何线程（包括 OpenMP 线程）之前调用，失败时返回空指针
+     */
+    static std::unique_ptr<ParameterMixer> spawn(size_t workers, size_t &index);
+
+    bool coordinator() const
+    {
+        return !pids.empty();
+    }
+
+    size_t workers() const
+    {
+        return coordinator() ? peers.size() : 0;
+    }
+
+    /**
+     * 以模型当前的权重作为混合的起点.
+     */
+    void reset(const Model &model)
+    {
+        base = model.parameters();
+    }
+
+    /**
+     * 和其他进程交换上次混合以来的权重变化，把模型更新为混合后的权重，通信失败时返回 false.
+     */
+    bool mix(Model &model);
+
+private:
+    explicit ParameterMixer(std::vector<int> &&peers_, std::vector<pid_t> &&pids_ = {}) :
+        peers(std::move(peers_)), pids(std::move(pids_)), base() {}
+
+    static bool send(int fd, const Parameters &parameters);
+
+    static bool receive(int fd, Parameters &parameters);
+
+    std::vector<int> peers;         ///< 协调进程中为各工作进程的套接字，工作进程中只有协调进程的套接字
+    std::vector<pid_t> pids;        ///< 工作进程号，只在协调进程中非空
+    Parameters base;                ///< 上次混合后的权重，按特征键排序
+};
+
+}   // namespace ime
+
+#endif  // _MIXING_H_
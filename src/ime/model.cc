@@ -2,33 +2,111 @@
  *
  */
 
+#include <cstdlib>
 #include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
 #include "model.h"
 #include "log.h"
+#include "trace.h"
 #include "common.h"
 
 
 namespace ime
 {
 
+namespace
+{
+
+/// 哈希特征空间的槽位数以这个名字保存为一行，值为 bits
+const std::string hash_bits_name = "hash_bits";
+/// 哈希特征空间的槽位保存为 "hashed:槽位"
+const std::string hashed_prefix = "hashed:";
+
+}   // namespace
+
 bool Model::save(std::ostream &os) const
 {
-    for (auto & i : weights)
+    assert(pending_bigrams.empty() && pending_sparse.empty());
+
+    size_t count = 0;
+    auto output = [&](const std::string &feature, double weight)
+    {
+        os << feature << '\t' << weight << std::endl;
+        ++count;
+    };
+
+    for (uint32_t tmpl = 0; tmpl < dense_weights.size(); ++tmpl)
+    {
+        dense_weights[tmpl].for_each([&](size_t value, double weight)
+        {
+            output(feature_name(tmpl, value), weight);
+        });
+    }
+
+    if (!hashed_weights.empty())
+    {
+        os << hash_bits_name << '\t' << hashed_weights.bits() << std::endl;
+        hashed_weights.for_each([&](size_t slot, double weight)
+        {
+            output(hashed_prefix + std::to_string(slot), weight);
+        });
+    }
+
+    if (_frozen)
     {
-        os << i.first << '\t' << i.second << std::endl;;
+        bigrams.for_each([&](size_t prev, size_t cur, double weight)
+        {
+            output(feature_name(bigram_template, BigramTable::key(prev, cur)), weight);
+        });
+        frozen_sparse_weights.for_each([&](uint64_t key, double weight)
+        {
+            output(feature_name(feature_template(key), feature_value(key)), weight);
+        });
+    }
+    else
+    {
+        bigram_weights.for_each([&](uint64_t key, double weight)
+        {
+            output(feature_name(bigram_template, key), weight);
+        });
+        sparse_weights.for_each([&](uint64_t key, double weight)
+        {
+            output(feature_name(feature_template(key), feature_value(key)), weight);
+        });
     }
 
-    INFO << weights.size() << " features saved" << std::endl;
+    for (auto &i : unknown_features)
+    {
+        output(i.first, i.second);
+    }
+
+    INFO << count << " features saved" << std::endl;
     return true;
 }
 
 bool Model::load(std::istream &is)
 {
-    weights.clear();
+    TRACE_SPAN("load");
+    for (auto &dense : dense_weights)
+    {
+        dense.clear();
+    }
+    bigram_weights.clear();
+    sparse_weights.clear();
+    bigrams.clear();
+    bigram_filter.clear();
+    frozen_sparse_weights.clear();
+    hashed_weights.clear();
+    unknown_features.clear();
+    admission.clear();
+    _frozen = false;
 
+    size_t count = 0;
     while (!is.eof())
     {
         std::string line;
@@ -41,88 +119,326 @@ bool Model::load(std::istream &is)
         if (!feature.empty())
         {
             VERBOSE << "load feature " << feature << ", weight = " << weight << std::endl;
-            weights.emplace(feature, weight);
+
+            if (feature == hash_bits_name)
+            {
+                hashed_weights.reset(static_cast<size_t>(weight));
+                continue;
+            }
+
+            ++count;
+            uint32_t tmpl;
+            uint64_t value;
+            size_t slot;
+            if (parse_hashed(feature, slot))
+            {
+                hashed_weights.set(slot, weight);
+            }
+            else if (!parse(feature, tmpl, value))
+            {
+                unknown_features.emplace_back(feature, weight);
+            }
+            else if ((templates[tmpl].storage == FeatureStorage::DENSE)
+                && dense_weights[tmpl].contains(value))
+            {
+                dense_weights[tmpl].set(value, weight);
+            }
+            else if (templates[tmpl].storage == FeatureStorage::BIGRAM)
+            {
+                bigram_weights.emplace(value, weight);
+            }
+            else
+            {
+                sparse_weights.emplace(feature_key(tmpl, value), weight);
+            }
         }
     }
 
-    INFO << weights.size() << " features loaded" << std::endl;
+    INFO << count << " features loaded, "
+        << bigram_weights.size() << " bigrams, "
+        << hashed_weights.size() << " hashed slots, "
+        << unknown_features.size() << " unknown" << std::endl;
     return true;
 }
 
-double Model::score(const Node &node) const
+std::vector<std::pair<uint64_t, double>> Model::parameters() const
 {
-    double sum = 0;
+    std::vector<std::pair<uint64_t, double>> result;
+    for (uint32_t tmpl = 0; tmpl < dense_weights.size(); ++tmpl)
+    {
+        dense_weights[tmpl].for_each([&](size_t value, double weight)
+        {
+            result.emplace_back(feature_key(tmpl, value), weight);
+        });
+    }
+
+    hashed_weights.for_each([&](size_t slot, double weight)
+    {
+        result.emplace_back(feature_key(hashed_template, slot), weight);
+    });
 
-    for (auto p = &node; p != nullptr; p = p->prev)
+    if (_frozen)
     {
-        for (auto &f : p->local_features)
+        bigrams.for_each([&](size_t prev, size_t cur, double weight)
         {
-            auto iter = weights.find(f.first);
-            if (iter != weights.cend())
-            {
-                sum += f.second * iter->second;
-            }
-        }
+            result.emplace_back(feature_key(bigram_template, BigramTable::key(prev, cur)), weight);
+        });
+        frozen_sparse_weights.for_each([&](uint64_t key, double weight)
+        {
+            result.emplace_back(key, weight);
+        });
+    }
+    else
+    {
+        bigram_weights.for_each([&](uint64_t key, double weight)
+        {
+            result.emplace_back(feature_key(bigram_template, key), weight);
+        });
+        sparse_weights.for_each([&](uint64_t key, double weight)
+        {
+            result.emplace_back(key, weight);
+        });
     }
 
-    for (auto &f : node.global_features)
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void Model::assign(const std::vector<std::pair<uint64_t, double>> &weights)
+{
+    thaw();
+
+    for (auto &i : weights)
     {
-        auto iter = weights.find(f.first);
-        if (iter != weights.cend())
+        auto tmpl = feature_template(i.first);
+        auto value = feature_value(i.first);
+        if (tmpl == hashed_template)
         {
-            sum += f.second * iter->second;
+            assert(value < hashed_weights.size());
+            hashed_weights.set(value, i.second);
         }
+        else if ((tmpl < dense_weights.size()) && dense_weights[tmpl].contains(value))
+        {
+            dense_weights[tmpl].set(value, i.second);
+        }
+        else if (tmpl == bigram_template)
+        {
+            bigram_weights.set(value, i.second);
+        }
+        else
+        {
+            sparse_weights.set(i.first, i.second);
+        }
+    }
+}
+
+bool Model::load_counts(std::istream &is)
+{
+    CountMinSketch counts;
+    if (!counts.load(is))
+    {
+        ERROR << "invalid feature admission counts" << std::endl;
+        return false;
+    }
+
+    if (admission.empty() || (counts.memory() != admission.memory()))
+    {
+        WARN << "feature admission counts ignored" << std::endl;
+        return true;
+    }
+
+    admission = std::move(counts);
+    return true;
+}
+
+bool Model::parse_hashed(const std::string &feature, size_t &slot) const
+{
+    if (hashed_weights.empty()
+        || (feature.compare(0, hashed_prefix.length(), hashed_prefix) != 0))
+    {
+        return false;
+    }
+
+    char *end;
+    auto v = strtoull(feature.c_str() + hashed_prefix.length(), &end, 10);
+    if ((*end != '\0') || (v >= hashed_weights.size()))
+    {
+        return false;
     }
 
-    return sum;
+    slot = static_cast<size_t>(v);
+    return true;
 }
 
-void Model::compute_score(Node &node) const
+double Model::hash(size_t bits)
 {
-    // 因为是线性模型且特征是子路径局部特征的超集，从前一个节点取局部特征分数以加速计算
-    node.local_score = (node.prev != nullptr) ? node.prev->local_score : 0;
+    assert(bits > 0);
+    assert(hashed_weights.empty());
+
+    auto frozen = _frozen;
+    thaw();
 
-    // 累加本节点局部特征的得分
-    for (auto &f : node.local_features)
+    HashedWeights hashed;
+    hashed.reset(bits);
+
+    // 逐个合并已有特征，落在已占用槽位的特征计为冲突
+    std::vector<bool> used(hashed.size(), false);
+    size_t count = 0;
+    size_t collisions = 0;
+    auto merge = [&](uint64_t key, double weight)
     {
-        auto iter = weights.find(f.first);
-        if (iter != weights.cend())
+        auto slot = hashed.slot(key);
+        if (used[slot])
         {
-            node.local_score += f.second * iter->second;
+            ++collisions;
         }
+        used[slot] = true;
+        ++count;
+        hashed.add(key, weight);
+    };
+
+    bigram_weights.for_each([&](uint64_t key, double weight)
+    {
+        merge(feature_key(bigram_template, key), weight);
+    });
+    sparse_weights.for_each(merge);
+    bigram_weights.clear();
+    sparse_weights.clear();
+    hashed_weights = std::move(hashed);
+
+    if (frozen)
+    {
+        freeze();
     }
 
-    // 再加上本节点（代表的路径）特有的全局特征
-    node.score = node.local_score;
-    for (auto &f : node.global_features)
+    auto rate = (count > 0) ? static_cast<double>(collisions) / count : 0.0;
+    INFO << "hash " << count << " features into " << hashed_weights.size() << " slots ("
+        << hashed_weights.memory() << " bytes), collision rate = " << rate << std::endl;
+    return rate;
+}
+
+bool Model::parse(const std::string &feature, uint32_t &tmpl, uint64_t &value) const
+{
+    auto pos = feature.find(':');
+    if (pos == std::string::npos)
+    {
+        return false;
+    }
+
+    for (tmpl = 0; tmpl < templates.size(); ++tmpl)
     {
-        auto iter = weights.find(f.first);
-        if (iter != weights.cend())
+        auto &t = templates[tmpl];
+        if ((t.parse != nullptr)
+            && (t.name.length() == pos)
+            && (feature.compare(0, pos, t.name) == 0))
         {
-            node.score += f.second * iter->second;
+            return t.parse(feature.substr(pos + 1), dict, value);
         }
     }
+
+    return false;
+}
+
+Model::Model(const Model &other, Snapshot) :
+    dict(other.dict),
+    templates(other.templates),
+    bigram_template(other.bigram_template),
+    dense_weights(other.dense_weights),
+    bigram_weights(),
+    sparse_weights(),
+    bigrams(),
+    bigram_filter(),
+    frozen_sparse_weights(),
+    hashed_weights(other.hashed_weights),
+    admission(other.admission),
+    admission_threshold(other.admission_threshold),
+    unknown_features(other.unknown_features),
+    pending_bigrams(items(other.bigram_weights)),
+    pending_sparse(items(other.sparse_weights)),
+    learning_rate(other.learning_rate),
+    _frozen(false)
+{
+    assert(!other._frozen);
 }
 
-std::ostream & Model::output_score(std::ostream &os, const Node &node) const
+std::unique_ptr<Model> Model::snapshot() const
 {
-    for (auto p = &node; p != nullptr; p = p->prev)
+    TRACE_SPAN("snapshot");
+    if (_frozen)
     {
-        for (auto &f : p->local_features)
+        return std::make_unique<Model>(*this);
+    }
+
+    return std::unique_ptr<Model>(new Model(*this, Snapshot()));
+}
+
+void Model::freeze()
+{
+    if (!_frozen)
+    {
+        // 快照的训练权重表为空，权重已经读出到 pending_bigrams 和 pending_sparse
+        if (pending_bigrams.empty() && pending_sparse.empty())
         {
-            os << f.first << ':' << f.second << " * ";
-            auto iter = weights.find(f.first);
-            os << ((iter != weights.cend()) ? iter->second : 0) << " + ";
+            pending_bigrams = items(bigram_weights);
+            bigram_weights.clear();
+            pending_sparse = items(sparse_weights);
+            sparse_weights.clear();
         }
+
+        bigrams.build(std::move(pending_bigrams), dict.word_count());
+        std::vector<std::pair<uint64_t, double>>().swap(pending_bigrams);
+
+        bigram_filter.reset(bigrams.size());
+        bigrams.for_each([&](size_t prev, size_t cur, double)
+        {
+            bigram_filter.add(BigramTable::key(prev, cur));
+        });
+
+        frozen_sparse_weights.build(pending_sparse);
+        std::vector<std::pair<uint64_t, double>>().swap(pending_sparse);
+        _frozen = true;
+
+        DEBUG << "model frozen, " << bigrams.size() << " bigrams, bigram filter "
+            << bigram_filter.memory() << " bytes, "
+            << frozen_sparse_weights.size() << " sparse features" << std::endl;
     }
-    for (auto &f : node.global_features)
+}
+
+void Model::thaw()
+{
+    if (_frozen)
     {
-        os << f.first << ':' << f.second << " * ";
-        auto iter = weights.find(f.first);
-        os << ((iter != weights.cend()) ? iter->second : 0) << " + ";
+        bigram_weights.reserve(bigrams.size());
+        bigrams.for_each([&](size_t prev, size_t cur, double weight)
+        {
+            bigram_weights.emplace(BigramTable::key(prev, cur), weight);
+        });
+        bigrams.clear();
+        bigram_filter.clear();
+
+        sparse_weights.reserve(frozen_sparse_weights.size());
+        frozen_sparse_weights.for_each([&](uint64_t key, double weight)
+        {
+            sparse_weights.emplace(key, weight);
+        });
+        frozen_sparse_weights.clear();
+        _frozen = false;
+
+        DEBUG << "model thawed, " << bigram_weights.size() << " bigrams, "
+            << sparse_weights.size() << " sparse features" << std::endl;
     }
+}
 
-    return os;
+template<typename Key>
+std::vector<std::pair<Key, double>> Model::items(const ConcurrentWeightMap<Key> &weights)
+{
+    std::vector<std::pair<Key, double>> result;
+    result.reserve(weights.size());
+    weights.for_each([&](const Key &key, double weight)
+    {
+        result.emplace_back(key, weight);
+    });
+    return result;
 }
 
 }   // namespace ime
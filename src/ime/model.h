@@ -6,15 +6,25 @@
 #define _MODEL_H_
 
 #include <cassert>
+#include <cstdint>
 #include <string>
 #include <vector>
-#include <unordered_map>
+#include <memory>
+#include <utility>
 #include <iostream>
 #include <fstream>
 
 #include "log.h"
 #include "common.h"
 #include "feature.h"
+#include "dict.h"
+#include "bigram.h"
+#include "flat_map.h"
+#include "concurrent_map.h"
+#include "bloom.h"
+#include "dense.h"
+#include "hashed.h"
+#include "sketch.h"
 
 
 namespace ime
@@ -23,12 +33,74 @@ namespace ime
 /**
  * 输入法模型，支持预测和更新操作.
  *
- * 当前只是稀疏线性模型，只支持普通 SGD 更新
+ * 当前只是稀疏线性模型，只支持普通 SGD 更新。
+ * 模型本身不关心特征如何提取，只按特征模板（见 feature.h）登记的存放方式保存权重：
+ * DENSE 模板的权重存放在按取值索引的数组中，bigram 以词编号对为键单独存放，
+ * 其余特征以打包后的 64 位特征键为键。
+ * 训练时权重存放在 ConcurrentWeightMap 中，多个线程可以同时更新；
+ * 冻结（freeze）后分别转换为只读的 BigramTable 和 FlatIntegerWeightMap，供预测使用。
+ * 默认特征集（DefaultFeatureSet）没有 SPARSE 模板，冻结后的 FlatIntegerWeightMap 几乎为空，
+ * 只有加入 SPARSE 模板后它才出现在解码的热路径上。
+ * 启用哈希特征空间（hash）后，DENSE 以外的特征全部存放在定长的 HashedWeights 中。
+ * 设置准入阈值（admit）后，新的 bigram 和稀疏特征先在 CountMinSketch 中计数，
+ * 更新过它的样本数达到阈值才创建权重
  */
 class Model
 {
 public:
-    explicit Model(double lr = 0.01) : weights(), learning_rate(lr) {}
+    /// 保留给哈希特征空间槽位的模板编号，见 parameters
+    static constexpr uint32_t hashed_template = max_feature_templates - 1;
+
+    explicit Model(const Dictionary &dict_, double lr = 0.01) :
+        dict(dict_),
+        templates(),
+        bigram_template(max_feature_templates),
+        dense_weights(),
+        bigram_weights(),
+        sparse_weights(),
+        bigrams(),
+        bigram_filter(),
+        frozen_sparse_weights(),
+        hashed_weights(),
+        admission(),
+        admission_threshold(0),
+        unknown_features(),
+        pending_bigrams(),
+        pending_sparse(),
+        learning_rate(lr),
+        _frozen(false) {}
+
+    /**
+     * 登记特征模板，由 FeatureSet::register_templates 调用.
+     */
+    template<typename Template>
+    void register_template()
+    {
+        static_assert(Template::id < hashed_template, "feature template id out of range");
+
+        if (templates.size() <= Template::id)
+        {
+            templates.resize(Template::id + 1);
+            dense_weights.resize(Template::id + 1);
+        }
+
+        templates[Template::id] = {
+            Template::name,
+            Template::storage,
+            &Template::format,
+            &Template::parse
+        };
+
+        if constexpr (Template::storage == FeatureStorage::DENSE)
+        {
+            dense_weights[Template::id] = DenseWeights(Template::name, Template::domain(dict));
+        }
+        else if constexpr (Template::storage == FeatureStorage::BIGRAM)
+        {
+            assert((bigram_template == max_feature_templates) || (bigram_template == Template::id));
+            bigram_template = Template::id;
+        }
+    }
 
     bool save(std::ostream &os) const;
 
@@ -46,65 +118,269 @@ public:
         return load(is);
     }
 
-    template<typename Iterator>
-    double score(Iterator begin, Iterator end) const
+    /**
+     * 把权重转换为只读的紧凑结构，冻结后不能再更新.
+     */
+    void freeze();
+
+    /**
+     * 解除冻结，恢复可更新的状态.
+     */
+    void thaw();
+
+    /**
+     * 复制模型作为检查点和评估的快照，不能和训练同时调用，快照使用前必须先 freeze.
+     *
+     * 训练权重表的条目各自单独分配，拷贝构造要逐个分配条目并重新插入。
+     * 快照只把训练权重表的条目顺序读到两个数组中，训练线程的停顿只有拷贝构造的几分之一，
+     * 建立冻结结构（排序、过滤器和扁平哈希表）的工作由快照的 freeze 完成，可以放在后台线程
+     */
+    std::unique_ptr<Model> snapshot() const;
+
+    /**
+     * 释放训练权重表扩容后留下的旧表，只能在没有并发更新和查找时调用，例如一批更新结束后.
+     */
+    void reclaim()
     {
-        double sum = 0;
+        bigram_weights.reclaim();
+        sparse_weights.reclaim();
+    }
 
-        for (auto i = begin; i != end; ++i)
+    bool frozen() const
+    {
+        return _frozen;
+    }
+
+    /**
+     * 切换到 2^bits 个槽位的哈希特征空间，内存不再随特征数增长.
+     *
+     * 已有的 bigram 和稀疏特征的权重按哈希合并到数组中，特征名随之丢失，
+     * 返回合并时和之前的特征落在同一槽位的特征比例（冲突率）
+     */
+    double hash(size_t bits);
+
+    bool hashed() const
+    {
+        return !hashed_weights.empty();
+    }
+
+    /**
+     * 设置特征准入阈值，新特征的更新次数达到 threshold 才创建权重，之前的更新被丢弃.
+     *
+     * 解码器每个样本对每个特征只调用一次 update（见 FeatureSet::update），更新次数即样本数。
+     * 计数使用每行 2^sketch_bits 个计数器的 count-min sketch，threshold 不大于 1 时关闭准入
+     */
+    void admit(size_t threshold, size_t sketch_bits = 20)
+    {
+        admission_threshold = threshold;
+        if (threshold > 1)
         {
-            auto iter = weights.find(i->first);
-            if (iter != weights.cend())
+            admission.reset(sketch_bits);
+            INFO << "feature admission threshold = " << threshold
+                << ", sketch " << admission.memory() << " bytes" << std::endl;
+        }
+        else
+        {
+            admission = CountMinSketch();
+        }
+    }
+
+    /**
+     * 全部可训练权重的 (特征键, 权重) 列表，按特征键排序，用于多进程训练的参数混合.
+     *
+     * 哈希特征空间的槽位以模板编号 hashed_template 打包为特征键，不包括未知特征
+     */
+    std::vector<std::pair<uint64_t, double>> parameters() const;
+
+    /**
+     * 按特征键设置权重，特征键的含义同 parameters，模型冻结时先解除冻结.
+     */
+    void assign(const std::vector<std::pair<uint64_t, double>> &weights);
+
+    /**
+     * 保存和载入特征准入的计数，和权重一起构成训练的检查点.
+     *
+     * 载入模型（load）会清空计数，恢复训练时应在载入模型之后载入计数。
+     * 未设置准入阈值或计数表大小与 admit 设置的不同时忽略载入的计数
+     */
+    bool save_counts(std::ostream &os) const
+    {
+        return admission.save(os);
+    }
+
+    bool load_counts(std::istream &is);
+
+    /**
+     * 模板 Template 取值为 value 的特征的权重，特征不存在时为 0.
+     */
+    template<typename Template>
+    double weight(uint64_t value) const
+    {
+        if constexpr (Template::storage == FeatureStorage::DENSE)
+        {
+            auto &dense = dense_weights[Template::id];
+            if (dense.contains(value))
             {
-                sum += i->second * iter->second;
+                return dense.get(value);
             }
         }
 
-        return sum;
+        if (!hashed_weights.empty())
+        {
+            return hashed_weights.get(feature_key(Template::id, value));
+        }
+        else if constexpr (Template::storage == FeatureStorage::BIGRAM)
+        {
+            return bigram_weight(value);
+        }
+        else
+        {
+            return sparse_weight(feature_key(Template::id, value));
+        }
+    }
+
+    /**
+     * 按 delta 和学习率更新模板 Template 取值为 value 的特征，可以由多个线程同时调用.
+     */
+    template<typename Template>
+    void update(uint64_t value, double delta)
+    {
+        assert(!_frozen);
+
+        VERBOSE << "update: " << feature_name<Template>(value) << ':' << weight<Template>(value)
+            << " + " << delta << " * " << learning_rate << std::endl;
+
+        if constexpr (Template::storage == FeatureStorage::DENSE)
+        {
+            auto &dense = dense_weights[Template::id];
+            if (dense.contains(value))
+            {
+                dense.add(value, delta * learning_rate);
+                return;
+            }
+        }
+
+        if (!hashed_weights.empty())
+        {
+            hashed_weights.add(feature_key(Template::id, value), delta * learning_rate);
+        }
+        else if constexpr (Template::storage == FeatureStorage::BIGRAM)
+        {
+            if (admitted(feature_key(Template::id, value), bigram_weights, value))
+            {
+                bigram_weights.add(value, delta * learning_rate);
+            }
+        }
+        else
+        {
+            auto key = feature_key(Template::id, value);
+            if (admitted(key, sparse_weights, key))
+            {
+                sparse_weights.add(key, delta * learning_rate);
+            }
+        }
     }
 
-    double score(const Node &node) const;
+    template<typename Template>
+    std::string feature_name(uint64_t value) const
+    {
+        return std::string(Template::name) + ':' + Template::format(value, dict);
+    }
 
-    void compute_score(Node &node) const;
+private:
+    /**
+     * 登记的特征模板信息，保存和载入时用于特征名和取值之间的转换.
+     */
+    struct TemplateInfo
+    {
+        std::string name;
+        FeatureStorage storage;
+        std::string (*format)(uint64_t, const Dictionary &);
+        bool (*parse)(const std::string &, const Dictionary &, uint64_t &);
+    };
 
-    template<typename Iterator>
-    void update(Iterator begin, Iterator end, double delta)
+    /**
+     * bigram 的权重，value 为 BigramTable::key.
+     */
+    double bigram_weight(uint64_t value) const
     {
-        for (auto i = begin; i != end; ++i)
+        if (_frozen)
+        {
+            // 大部分 bigram 从未在训练语料中出现，先用过滤器排除
+            return bigram_filter.may_contain(value)
+                ? bigrams.weight(BigramTable::prev_id(value), BigramTable::cur_id(value)) : 0;
+        }
+        else
         {
-            DEBUG << "update: " << i->first << ':' << weights[i->first]
-                << " + " << i->second << " * " << delta << " * " << learning_rate
-                << " = " << weights[i->first] + i->second * delta * learning_rate << std::endl;
-            weights[i->first] += i->second * delta * learning_rate;
+            assert(pending_bigrams.empty());
+            return bigram_weights.get(value);
         }
     }
 
-    template<typename FeatureIterator, typename DeltaIterator>
-    void update(
-        FeatureIterator feature_begin,
-        FeatureIterator feature_end,
-        DeltaIterator delta_begin,
-        DeltaIterator delta_end
-    )
-    {
-        FeatureIterator fi;
-        DeltaIterator di;
-        for (
-            fi = feature_begin, di = delta_begin;
-            (fi != feature_end) && (di != delta_end);
-            ++fi, ++di
-        )
-        {
-            DEBUG << "update: " << *fi << " +" << *di << std::endl;;
-            update(fi->begin(), fi->end(), *di);
+    double sparse_weight(uint64_t key) const
+    {
+        if (_frozen)
+        {
+            return frozen_sparse_weights.weight(key);
+        }
+        else
+        {
+            assert(pending_sparse.empty());
+            return sparse_weights.get(key);
         }
     }
 
-    std::ostream & output_score(std::ostream &os, const Node &node) const;
+    std::string feature_name(uint32_t tmpl, uint64_t value) const
+    {
+        assert((tmpl < templates.size()) && (templates[tmpl].format != nullptr));
+        return templates[tmpl].name + ':' + templates[tmpl].format(value, dict);
+    }
 
-private:
-    std::unordered_map<std::string, double> weights;
+    /**
+     * 解析特征名，得到模板编号和取值，不属于任何已登记模板时返回 false.
+     */
+    bool parse(const std::string &feature, uint32_t &tmpl, uint64_t &value) const;
+
+    bool parse_hashed(const std::string &feature, size_t &slot) const;
+
+    /**
+     * 特征是否可以写入 weights：已有权重的特征总是可以，新特征在计数达到准入阈值后才可以.
+     */
+    bool admitted(uint64_t feature, const ConcurrentWeightMap<uint64_t> &weights, uint64_t key)
+    {
+        return (admission_threshold <= 1)
+            || weights.contains(key)
+            || (admission.add(feature) >= admission_threshold);
+    }
+
+    struct Snapshot {};
+
+    /**
+     * 复制 other 中训练权重表以外的部分，训练权重读出到 pending_bigrams 和 pending_sparse，见 snapshot.
+     */
+    Model(const Model &other, Snapshot);
+
+    template<typename Key>
+    static std::vector<std::pair<Key, double>> items(const ConcurrentWeightMap<Key> &weights);
+
+    const Dictionary &dict;
+    std::vector<TemplateInfo> templates;                    ///< 以模板编号为下标
+    uint32_t bigram_template;                               ///< 使用 BIGRAM 存放方式的模板编号
+    std::vector<DenseWeights> dense_weights;                ///< 以模板编号为下标
+    ConcurrentWeightMap<uint64_t> bigram_weights;           ///< 训练时的 bigram 权重
+    ConcurrentWeightMap<uint64_t> sparse_weights;           ///< 训练时的稀疏特征权重
+    BigramTable bigrams;                                    ///< 冻结后的 bigram 权重
+    BloomFilter bigram_filter;                              ///< 冻结后存在的 bigram
+    FlatIntegerWeightMap frozen_sparse_weights;             ///< 冻结后的稀疏特征权重
+    HashedWeights hashed_weights;                           ///< 哈希特征空间，未启用时为空
+    CountMinSketch admission;                               ///< 新特征的更新次数
+    size_t admission_threshold;
+    /// 载入时不属于任何模板的特征，例如词典中不存在的词，原样保留以便保存时不丢失
+    std::vector<std::pair<std::string, double>> unknown_features;
+    std::vector<std::pair<uint64_t, double>> pending_bigrams;   ///< 快照尚未冻结的 bigram 权重
+    std::vector<std::pair<uint64_t, double>> pending_sparse;    ///< 快照尚未冻结的稀疏特征权重
     double learning_rate;
+    bool _frozen;
 };
 
 }   // namespace ime
@@ -0,0 +1,159 @@
+/**
+ *
+ */
+
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // __linux__
+
+#include "perf.h"
+#include "log.h"
+
+
+namespace ime
+{
+
+namespace
+{
+
+#ifdef __linux__
+
+constexpr size_t event_count = 4;
+
+/**
+ * 一个线程的计数器组，第一个计数器为组长，读组长时一次读出全部计数器.
+ */
+struct CounterGroup
+{
+    int fds[event_count];
+    bool tried;
+    bool opened;
+
+    CounterGroup() : tried(false), opened(false)
+    {
+        for (auto &fd : fds)
+        {
+            fd = -1;
+        }
+    }
+
+    ~CounterGroup()
+    {
+        close();
+    }
+
+    bool open()
+    {
+        static const uint64_t configs[event_count] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+
+        tried = true;
+        for (size_t i = 0; i < event_count; ++i)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // pid = 0, cpu = -1 统计当前线程在任意 CPU 上的事件
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, (i == 0) ? -1 : fds[0], 0);
+            if (fds[i] < 0)
+            {
+                auto error = errno;
+                close();
+                errno = error;
+                return false;
+            }
+        }
+
+        opened = true;
+        return true;
+    }
+
+    void close()
+    {
+        for (auto &fd : fds)
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        opened = false;
+    }
+
+    bool read(PerfValues &values)
+    {
+        if (!tried)
+        {
+            open();
+        }
+        if (!opened)
+        {
+            return false;
+        }
+
+        uint64_t buffer[3 + event_count];
+        if (::read(fds[0], buffer, sizeof(buffer)) != sizeof(buffer) || (buffer[0] != event_count))
+        {
+            return false;
+        }
+
+        // 硬件计数器不够时内核轮流启用各组，按实际计数的时间比例估算
+        double scale = ((buffer[2] > 0) && (buffer[2] < buffer[1])) ? static_cast<double>(buffer[1]) / buffer[2] : 1;
+        values.cycles = buffer[3] * scale;
+        values.instructions = buffer[4] * scale;
+        values.cache_misses = buffer[5] * scale;
+        values.branch_misses = buffer[6] * scale;
+        return true;
+    }
+};
+
+thread_local CounterGroup local_group;
+
+#endif  // __linux__
+
+}   // namespace
+
+std::atomic<bool> PerfCounters::_enabled(false);
+
+bool PerfCounters::start()
+{
+#ifdef __linux__
+    if (local_group.opened || local_group.open())
+    {
+        _enabled.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    INFO << "hardware counters unavailable (" << strerror(errno) << "), timing only" << std::endl;
+#else
+    INFO << "hardware counters unavailable on this platform, timing only" << std::endl;
+#endif  // __linux__
+    return false;
+}
+
+bool PerfCounters::read(PerfValues &values)
+{
+#ifdef __linux__
+    return enabled() && local_group.read(values);
+#else
+    return false;
+#endif  // __linux__
+}
+
+}   // namespace ime
@@ -0,0 +1,84 @@
+/**
+ * 硬件性能计数器.
+ */
+
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <cstdint>
+#include <atomic>
+
+
+namespace ime
+{
+
+/**
+ * 一组硬件计数器的读数或差值.
+ */
+struct PerfValues
+{
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;      ///< 最后一级缓存未命中
+    uint64_t branch_misses;
+
+    PerfValues() : cycles(0), instructions(0), cache_misses(0), branch_misses(0) {}
+
+    PerfValues & operator += (const PerfValues &other)
+    {
+        cycles += other.cycles;
+        instructions += other.instructions;
+        cache_misses += other.cache_misses;
+        branch_misses += other.branch_misses;
+        return *this;
+    }
+
+    PerfValues operator - (const PerfValues &other) const
+    {
+        PerfValues result;
+        result.cycles = cycles - other.cycles;
+        result.instructions = instructions - other.instructions;
+        result.cache_misses = cache_misses - other.cache_misses;
+        result.branch_misses = branch_misses - other.branch_misses;
+        return result;
+    }
+};
+
+/**
+ * 通过 Linux 的 perf_event_open 读取当前线程的周期数、指令数、缓存未命中和分支预测失败次数.
+ *
+ * 每个线程第一次读取时打开自己的一组计数器，只统计用户态，各线程的读数互不相干，
+ * 只能在同一线程内求差。每次读取是一次系统调用（约 1 微秒），只适合按阶段累计，
+ * 打开后同时测量的耗时也会偏高。内核不允许（perf_event_paranoid）或者虚拟机没有
+ * 暴露硬件计数器时，start 返回 false，之后的读取都返回 false，调用方只统计耗时
+ */
+class PerfCounters
+{
+public:
+    /**
+     * 尝试在当前线程打开计数器，成功后各线程的 read 才会读取.
+     */
+    static bool start();
+
+    static void stop()
+    {
+        _enabled.store(false, std::memory_order_relaxed);
+    }
+
+    static bool enabled()
+    {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * 读取当前线程计数器的累计值，没有开始或无法打开时返回 false.
+     */
+    static bool read(PerfValues &values);
+
+private:
+    static std::atomic<bool> _enabled;
+};
+
+}   // namespace ime
+
+#endif  // _PERF_H_
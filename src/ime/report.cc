@@ -0,0 +1,301 @@
+/**
+ *
+ */
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include "report.h"
+
+
+namespace ime
+{
+
+namespace
+{
+
+/**
+ * 输出 JSON 数值，NaN 和无穷大输出为 null.
+ */
+std::string number(double x)
+{
+    if (!std::isfinite(x))
+    {
+        return "null";
+    }
+
+    std::ostringstream ss;
+    ss << x;
+    return ss.str();
+}
+
+/**
+ * 输出 JSON 字符串，只转义引号、反斜杠和控制字符.
+ */
+std::string quote(const std::string &s)
+{
+    std::string result = "\"";
+    for (auto c : s)
+    {
+        if ((c == '"') || (c == '\\'))
+        {
+            result += '\\';
+            result += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            result += ' ';
+        }
+        else
+        {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+/**
+ * 已排序数组的分位数，取最近秩（nearest rank）.
+ */
+double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return NAN;
+    }
+
+    auto rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+/**
+ * 输出平均到每个样本的搜索统计量.
+ */
+void write_stats(std::ostream &os, const SearchStats &stats, double n)
+{
+    os << "{\"decodes\": " << number(stats.decodes / n)
+        << ", \"positions\": " << number(stats.positions / n)
+        << ", \"nodes\": " << number(stats.nodes / n)
+        << ", \"lookups\": " << number(stats.lookups / n)
+        << ", \"hits\": " << number(stats.hits / n)
+        << ", \"pruned\": " << number(stats.pruned / n)
+        << ", \"max_candidates\": " << stats.max_candidates << "}";
+}
+
+/**
+ * 输出平均到每个编码字符的硬件计数.
+ */
+void write_counters(std::ostream &os, const PerfValues &values, double chars)
+{
+    os << "{\"cycles\": " << number(values.cycles / chars)
+        << ", \"instructions\": " << number(values.instructions / chars)
+        << ", \"cache_misses\": " << number(values.cache_misses / chars)
+        << ", \"branch_misses\": " << number(values.branch_misses / chars) << "}";
+}
+
+/**
+ * 输出一组样本的延迟分布、各阶段的平均耗时（微秒）和平均搜索统计量，counted 为 true 时还输出各阶段的硬件计数.
+ */
+void write_latency(
+    std::ostream &os,
+    const std::vector<const SampleRecord *> &records,
+    const std::string &indent,
+    bool counted
+)
+{
+    std::vector<double> latencies;
+    latencies.reserve(records.size());
+    SearchStats stats;
+    double sum = 0;
+    double chars = 0;
+    for (auto r : records)
+    {
+        latencies.push_back(r->latency * 1e6);
+        stats += r->stats;
+        sum += r->latency;
+        chars += r->code.length();
+    }
+    auto &phases = stats.phases;
+    std::sort(latencies.begin(), latencies.end());
+
+    double n = records.size();
+    os << indent << "\"latency_us\": {"
+        << "\"mean\": " << number(sum * 1e6 / n)
+        << ", \"p50\": " << number(percentile(latencies, 0.5))
+        << ", \"p90\": " << number(percentile(latencies, 0.9))
+        << ", \"p99\": " << number(percentile(latencies, 0.99))
+        << ", \"p999\": " << number(percentile(latencies, 0.999))
+        << ", \"max\": " << number(latencies.empty() ? NAN : latencies.back())
+        << "}," << std::endl;
+
+    os << indent << "\"phases_us\": {"
+        << "\"lookup\": " << number(phases.lookup * 1e6 / n)
+        << ", \"extract\": " << number(phases.extract * 1e6 / n)
+        << ", \"score\": " << number(phases.score * 1e6 / n)
+        << ", \"topk\": " << number(phases.topk * 1e6 / n)
+        << ", \"other\": " << number((sum - phases.total()) * 1e6 / n)
+        << "}," << std::endl;
+
+    if (counted)
+    {
+        auto &counters = stats.counters;
+        PerfValues total;
+        total += counters.lookup;
+        total += counters.extract;
+        total += counters.score;
+        total += counters.topk;
+
+        os << indent << "\"counters_per_char\": {\"lookup\": ";
+        write_counters(os, counters.lookup, chars);
+        os << ", \"extract\": ";
+        write_counters(os, counters.extract, chars);
+        os << ", \"score\": ";
+        write_counters(os, counters.score, chars);
+        os << ", \"topk\": ";
+        write_counters(os, counters.topk, chars);
+        os << ", \"total\": ";
+        write_counters(os, total, chars);
+        os << "}," << std::endl;
+    }
+
+    os << indent << "\"search\": ";
+    write_stats(os, stats, n);
+}
+
+}   // namespace
+
+double EvaluationReport::latency(double p) const
+{
+    std::vector<double> latencies;
+    latencies.reserve(records.size());
+    for (auto &r : records)
+    {
+        latencies.push_back(r.latency);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return percentile(latencies, p);
+}
+
+std::ostream & EvaluationReport::write(std::ostream &os, const Metrics &metrics) const
+{
+    std::vector<const SampleRecord *> all;
+    all.reserve(records.size());
+    size_t max_length = 0;
+    size_t max_thread = 0;
+    for (auto &r : records)
+    {
+        all.push_back(&r);
+        max_length = std::max(max_length, r.code.length());
+        max_thread = std::max(max_thread, r.thread);
+    }
+
+    os << "{" << std::endl
+        << "  \"beam_size\": " << beam_size << "," << std::endl
+        << "  \"threads\": " << threads << "," << std::endl
+        << "  \"samples\": " << records.size() << "," << std::endl
+        << "  \"wall_seconds\": " << number(wall_seconds) << "," << std::endl
+        << "  \"samples_per_second\": " << number(throughput()) << "," << std::endl
+        << "  \"hardware_counters\": " << (counted ? "true" : "false") << "," << std::endl;
+
+    os << "  \"metrics\": {";
+    for (auto i = metrics.begin(); i != metrics.end(); ++i)
+    {
+        os << ((i == metrics.begin()) ? "" : ", ") << quote(i->first) << ": " << number(i->second);
+    }
+    os << "}," << std::endl;
+
+    write_latency(os, all, "  ", counted);
+    os << "," << std::endl;
+
+    // 各线程的吞吐率按线程忙于预测的时间计算，不包括等待同一批其他样本的时间
+    std::vector<size_t> thread_samples(records.empty() ? 0 : max_thread + 1, 0);
+    std::vector<double> thread_seconds(thread_samples.size(), 0);
+    for (auto &r : records)
+    {
+        ++thread_samples[r.thread];
+        thread_seconds[r.thread] += r.latency;
+    }
+
+    os << "  \"per_thread\": [";
+    for (size_t i = 0; i < thread_samples.size(); ++i)
+    {
+        os << ((i == 0) ? "" : ",") << std::endl
+            << "    {\"thread\": " << i
+            << ", \"samples\": " << thread_samples[i]
+            << ", \"busy_seconds\": " << number(thread_seconds[i])
+            << ", \"samples_per_second\": " << number(thread_samples[i] / thread_seconds[i]) << "}";
+    }
+    os << std::endl << "  ]," << std::endl;
+
+    os << "  \"length_buckets\": [";
+    bool first = true;
+    for (size_t low = 1; low <= max_length; low += bucket_width)
+    {
+        auto high = low + bucket_width - 1;
+        std::vector<const SampleRecord *> bucket;
+        double weight = 0;
+        double succ = 0;
+        double prec = 0;
+        for (auto r : all)
+        {
+            if ((r->code.length() >= low) && (r->code.length() <= high))
+            {
+                bucket.push_back(r);
+                weight += r->weight;
+                if (r->index >= 0)
+                {
+                    succ += r->weight;
+                    if (r->index == 0)
+                    {
+                        prec += r->weight;
+                    }
+                }
+            }
+        }
+
+        if (bucket.empty())
+        {
+            continue;
+        }
+
+        os << (first ? "" : ",") << std::endl
+            << "    {" << std::endl
+            << "      \"min_length\": " << low << "," << std::endl
+            << "      \"max_length\": " << high << "," << std::endl
+            << "      \"samples\": " << bucket.size() << "," << std::endl
+            << "      \"count\": " << number(weight) << "," << std::endl
+            << "      \"success_rate\": " << number(succ / weight) << "," << std::endl
+            << "      \"precision\": " << number(prec / succ) << "," << std::endl;
+        write_latency(os, bucket, "      ", counted);
+        os << std::endl << "    }";
+        first = false;
+    }
+    os << std::endl << "  ]," << std::endl;
+
+    auto n = std::min(slowest, all.size());
+    std::partial_sort(all.begin(), all.begin() + n, all.end(), [](const SampleRecord *a, const SampleRecord *b)
+    {
+        return a->latency > b->latency;
+    });
+
+    os << "  \"slowest\": [";
+    for (size_t i = 0; i < n; ++i)
+    {
+        os << ((i == 0) ? "" : ",") << std::endl
+            << "    {\"code\": " << quote(all[i]->code)
+            << ", \"thread\": " << all[i]->thread
+            << ", \"latency_us\": " << number(all[i]->latency * 1e6)
+            << ", \"search\": ";
+        write_stats(os, all[i]->stats, 1);
+        os << "}";
+    }
+    os << std::endl << "  ]" << std::endl << "}" << std::endl;
+
+    return os;
+}
+
+}   // namespace ime
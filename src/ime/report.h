@@ -0,0 +1,325 @@
+/**
+ * 评估报告.
+ */
+
+#ifndef _REPORT_H_
+#define _REPORT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "common.h"
+#include "perf.h"
+#include "alloc.h"
+
+
+namespace ime
+{
+
+/**
+ * 解码各阶段的耗时（秒）.
+ */
+struct PhaseTimes
+{
+    double lookup;      ///< 按编码子串查找词典
+    double extract;     ///< 从候选节点提取特征
+    double score;       ///< 按特征权重计分
+    double topk;        ///< 排序并截取集束
+    double update;      ///< 训练时按梯度更新模型权重
+
+    PhaseTimes() : lookup(0), extract(0), score(0), topk(0), update(0) {}
+
+    double total() const
+    {
+        return lookup + extract + score + topk + update;
+    }
+
+    PhaseTimes & operator += (const PhaseTimes &other)
+    {
+        lookup += other.lookup;
+        extract += other.extract;
+        score += other.score;
+        topk += other.topk;
+        update += other.update;
+        return *this;
+    }
+};
+
+/**
+ * 解码各阶段的硬件计数器差值，阶段的划分和 PhaseTimes 相同.
+ */
+struct PhaseCounters
+{
+    PerfValues lookup;
+    PerfValues extract;
+    PerfValues score;
+    PerfValues topk;
+    PerfValues update;
+
+    PhaseCounters & operator += (const PhaseCounters &other)
+    {
+        lookup += other.lookup;
+        extract += other.extract;
+        score += other.score;
+        topk += other.topk;
+        update += other.update;
+        return *this;
+    }
+};
+
+/**
+ * 解码、提早更新（包括其中的解码）和批量更新（包括全部线程）各自的堆分配统计.
+ */
+struct AllocProfile
+{
+    AllocStats decode;
+    AllocStats early_update;
+    AllocStats batch;
+
+    AllocProfile & operator += (const AllocProfile &other)
+    {
+        decode += other.decode;
+        early_update += other.early_update;
+        batch += other.batch;
+        return *this;
+    }
+};
+
+/**
+ * 集束搜索的统计量，用于分析解码慢的原因.
+ *
+ * 计数器在解码时随结果一起返回（传入非空的指针时才统计），开销只是几次加法；
+ * timed 为 true 时还统计各阶段的耗时，需要读取时钟，只在生成评估报告时打开；
+ * 此时如果 PerfCounters 已经开始，同时累计各阶段的硬件计数器。
+ * AllocCounter 开始后不论 timed 都统计堆分配
+ */
+struct SearchStats
+{
+    uint64_t decodes;       ///< 解码次数，包括加大集束后的重试和训练时的强制搜索
+    uint64_t positions;     ///< 推进的位置数
+    uint64_t nodes;         ///< 生成的候选节点数（满足约束的移进和归约节点）
+    uint64_t lookups;       ///< 查找词典的次数
+    uint64_t hits;          ///< 查到至少一个词的查找次数
+    uint64_t pruned;        ///< 被 topk 剪掉的候选节点数
+    uint64_t forced;        ///< 训练时目标路径掉出集束后被强制加回的次数
+    uint64_t retries;       ///< 训练时没有搜索到目标文本，加倍集束重试的次数
+    uint64_t max_candidates;    ///< 一个位置上候选节点数的最大值
+    bool timed;
+    PhaseTimes phases;
+    PhaseCounters counters;
+    AllocProfile allocs;
+
+    explicit SearchStats(bool timed_ = false) :
+        decodes(0),
+        positions(0),
+        nodes(0),
+        lookups(0),
+        hits(0),
+        pruned(0),
+        forced(0),
+        retries(0),
+        max_candidates(0),
+        timed(timed_),
+        phases(),
+        counters(),
+        allocs() {}
+
+    SearchStats & operator += (const SearchStats &other)
+    {
+        decodes += other.decodes;
+        positions += other.positions;
+        nodes += other.nodes;
+        lookups += other.lookups;
+        hits += other.hits;
+        pruned += other.pruned;
+        forced += other.forced;
+        retries += other.retries;
+        max_candidates = std::max(max_candidates, other.max_candidates);
+        phases += other.phases;
+        counters += other.counters;
+        allocs += other.allocs;
+        return *this;
+    }
+
+    /**
+     * 把平均到每次解码、每个位置或每个样本的统计量写入 metrics，samples 为样本个数.
+     */
+    void report(Metrics &metrics, double samples) const
+    {
+        metrics.set("nodes per position", static_cast<double>(nodes) / positions);
+        metrics.set("dict hit rate", static_cast<double>(hits) / lookups);
+        metrics.set("pruned rate", static_cast<double>(pruned) / nodes);
+        metrics.set("max candidates", max_candidates);
+        metrics.set("decodes per sample", decodes / samples);
+        if (forced > 0)
+        {
+            metrics.set("forced per sample", forced / samples);
+        }
+        if (retries > 0)
+        {
+            metrics.set("retry rate", retries / samples);
+        }
+
+        report(metrics, "decode", allocs.decode);
+        report(metrics, "early update", allocs.early_update);
+        report(metrics, "batch", allocs.batch);
+    }
+
+private:
+    /**
+     * 写入平均到每个区间的分配次数、字节数和最大的峰值存活字节数，没有统计时不写入.
+     */
+    static void report(Metrics &metrics, const std::string &name, const AllocStats &stats)
+    {
+        if (stats.scopes > 0)
+        {
+            metrics.set("allocations per " + name, static_cast<double>(stats.count) / stats.scopes);
+            metrics.set("allocated bytes per " + name, static_cast<double>(stats.bytes) / stats.scopes);
+            metrics.set("peak live bytes per " + name, stats.peak);
+        }
+    }
+};
+
+/**
+ * 一个阶段开始时的时钟和硬件计数器读数.
+ */
+class PhaseMark
+{
+public:
+    PhaseMark() : counters(), counted(false), time() {}
+
+    void start()
+    {
+        counted = PerfCounters::read(counters);
+        time = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * 把从 start 到现在的耗时（秒）和计数器差值分别累加到 seconds 和 values.
+     */
+    void stop(double &seconds, PerfValues &values) const
+    {
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - time).count();
+
+        PerfValues current;
+        if (counted && PerfCounters::read(current))
+        {
+            values += current - counters;
+        }
+    }
+
+private:
+    PerfValues counters;
+    bool counted;           ///< 开始时是否读到了计数器
+    std::chrono::steady_clock::time_point time;
+};
+
+/**
+ * 一个评估样本的结果和耗时.
+ */
+struct SampleRecord
+{
+    std::string code;
+    size_t thread;          ///< 评估该样本的线程编号
+    double weight;
+    int index;              ///< 目标文本在预测结果中的位置，-1 为无法解码
+    double latency;         ///< 预测的总耗时（秒），包括各阶段以外的路径回溯和概率计算
+    SearchStats stats;      ///< 搜索统计量和各阶段的耗时
+
+    SampleRecord() : code(), thread(0), weight(0), index(-1), latency(0), stats(true) {}
+};
+
+/**
+ * 语料级的评估报告，在评估指标之外统计延迟分布、各线程吞吐率、各阶段耗时，并按编码长度分组，以 JSON 输出.
+ *
+ * 报告还列出延迟最高的几个样本的编码和搜索统计量（见 SearchStats）。
+ * 评估时硬件计数器可用（见 PerfCounters）则同时输出各阶段平均到每个编码字符的计数。
+ *
+ * 延迟的分位数按样本行计算，不乘权重；精度等指标和 Metrics 一样按权重计算。
+ * 分阶段计时本身有开销，报告中的延迟比不计时的评估略高，适合在不同模型之间比较
+ */
+class EvaluationReport
+{
+public:
+    /**
+     * bucket_width 为编码长度分组的宽度，第 i 组为长度 [i * width + 1, (i + 1) * width] 的样本.
+     */
+    explicit EvaluationReport(size_t bucket_width_ = 4, size_t slowest_ = 10) :
+        bucket_width(std::max<size_t>(bucket_width_, 1)),
+        slowest(slowest_),
+        beam_size(0),
+        threads(0),
+        wall_seconds(0),
+        counted(false),
+        records() {}
+
+    void clear()
+    {
+        wall_seconds = 0;
+        records.clear();
+    }
+
+    /**
+     * 记录评估的设置，threads 为评估使用的线程数.
+     */
+    void setup(size_t beam_size_, size_t threads_)
+    {
+        beam_size = beam_size_;
+        threads = threads_;
+        counted = PerfCounters::enabled();
+    }
+
+    void add(const SampleRecord &record)
+    {
+        records.push_back(record);
+    }
+
+    /**
+     * 累加评估的墙钟时间.
+     */
+    void elapse(double seconds)
+    {
+        wall_seconds += seconds;
+    }
+
+    const std::vector<SampleRecord> & samples() const
+    {
+        return records;
+    }
+
+    /**
+     * 按墙钟时间计算的吞吐率（样本每秒）.
+     */
+    double throughput() const
+    {
+        return records.size() / wall_seconds;
+    }
+
+    /**
+     * 延迟（秒）的 p 分位数，0 < p <= 1.
+     */
+    double latency(double p) const;
+
+    /**
+     * 以 JSON 输出报告，metrics 为同一次评估的指标.
+     */
+    std::ostream & write(std::ostream &os, const Metrics &metrics) const;
+
+private:
+    size_t bucket_width;
+    size_t slowest;         ///< 列出延迟最高的样本个数，用于把延迟异常和搜索规模对应起来
+    size_t beam_size;
+    size_t threads;
+    double wall_seconds;
+    bool counted;           ///< 评估时是否读取了硬件计数器
+    std::vector<SampleRecord> records;
+};
+
+}   // namespace ime
+
+#endif  // _REPORT_H_
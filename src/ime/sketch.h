@@ -0,0 +1,162 @@
+/**
+ * Count-min sketch.
+ */
+
+#ifndef _SKETCH_H_
+#define _SKETCH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+
+#include "common.h"
+
+
+namespace ime
+{
+
+/**
+ * 近似计数的 count-min sketch，用于训练时的特征准入.
+ *
+ * depth 行计数器，每行 2^bits 个，键在每行落入一个计数器，
+ * 估计值取各行计数器的最小值，只会高估不会低估。
+ * 计数器是原子变量，可以由多个线程同时计数
+ */
+class CountMinSketch
+{
+public:
+    CountMinSketch() : width(0), mask(0), counters() {}
+
+    CountMinSketch(const CountMinSketch &other) :
+        width(other.width),
+        mask(other.mask),
+        counters(new std::atomic<uint32_t>[other.width * depth])
+    {
+        for (size_t i = 0; i < width * depth; ++i)
+        {
+            counters[i].store(other.counters[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    CountMinSketch(CountMinSketch &&other) = default;
+
+    CountMinSketch & operator = (CountMinSketch &&other) = default;
+
+    /**
+     * 分配每行 2^bits 个计数器并清零.
+     */
+    void reset(size_t bits)
+    {
+        width = static_cast<size_t>(1) << bits;
+        mask = width - 1;
+        counters.reset(new std::atomic<uint32_t>[width * depth]);
+        clear();
+    }
+
+    /**
+     * 计数清零，保留已分配的空间.
+     */
+    void clear()
+    {
+        for (size_t i = 0; i < width * depth; ++i)
+        {
+            counters[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    bool empty() const
+    {
+        return width == 0;
+    }
+
+    size_t memory() const
+    {
+        return width * depth * sizeof(uint32_t);
+    }
+
+    /**
+     * 计数加一，返回加一后的估计值.
+     */
+    uint32_t add(uint64_t key)
+    {
+        auto h = mix64(key);
+        auto result = std::numeric_limits<uint32_t>::max();
+        for (size_t i = 0; i < depth; ++i)
+        {
+            auto count = counters[index(h, i)].fetch_add(1, std::memory_order_relaxed) + 1;
+            result = std::min(result, count);
+        }
+        return result;
+    }
+
+    /**
+     * 以本机字节序保存和载入全部计数，用于训练的检查点.
+     */
+    bool save(std::ostream &os) const
+    {
+        uint64_t w = width;
+        os.write(reinterpret_cast<const char *>(&w), sizeof(w));
+        for (size_t i = 0; i < width * depth; ++i)
+        {
+            auto count = counters[i].load(std::memory_order_relaxed);
+            os.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        }
+        return static_cast<bool>(os);
+    }
+
+    bool load(std::istream &is)
+    {
+        uint64_t w = 0;
+        if (!is.read(reinterpret_cast<char *>(&w), sizeof(w)) || ((w & (w - 1)) != 0))
+        {
+            return false;
+        }
+
+        width = static_cast<size_t>(w);
+        mask = (width > 0) ? width - 1 : 0;
+        counters.reset((width > 0) ? new std::atomic<uint32_t>[width * depth] : nullptr);
+        for (size_t i = 0; i < width * depth; ++i)
+        {
+            uint32_t count = 0;
+            is.read(reinterpret_cast<char *>(&count), sizeof(count));
+            counters[i].store(count, std::memory_order_relaxed);
+        }
+        return static_cast<bool>(is);
+    }
+
+    uint32_t count(uint64_t key) const
+    {
+        auto h = mix64(key);
+        auto result = std::numeric_limits<uint32_t>::max();
+        for (size_t i = 0; i < depth; ++i)
+        {
+            result = std::min(result, counters[index(h, i)].load(std::memory_order_relaxed));
+        }
+        return result;
+    }
+
+private:
+    static constexpr size_t depth = 4;
+
+    /**
+     * 第 i 行计数器的下标，由哈希值的高低 32 位做双重哈希得到.
+     */
+    size_t index(uint64_t h, size_t i) const
+    {
+        auto h1 = static_cast<size_t>(h & 0xffffffff);
+        auto h2 = static_cast<size_t>(h >> 32) | 1;
+        return i * width + ((h1 + i * h2) & mask);
+    }
+
+    size_t width;       ///< 每行计数器个数
+    size_t mask;
+    std::unique_ptr<std::atomic<uint32_t>[]> counters;
+};
+
+}   // namespace ime
+
+#endif  // _SKETCH_H_
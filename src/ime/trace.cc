@@ -0,0 +1,220 @@
+/**
+ *
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+
+#include <unistd.h>
+
+#include "trace.h"
+#include "log.h"
+
+
+namespace ime
+{
+
+namespace
+{
+
+struct Event
+{
+    const char *name;
+    int64_t begin;
+    int64_t end;
+};
+
+/**
+ * 一个线程的环形缓冲区，只由所属线程写入，写入、重置和导出都持有 mutex.
+ *
+ * 所属线程没有竞争，加锁不经过系统调用；开始记录和导出时由其他线程持锁，
+ * 不会和正在进行的写入交错
+ */
+struct TraceBuffer
+{
+    std::mutex mutex;
+    uint32_t tid;
+    std::vector<Event> events;
+    size_t count;               ///< 已记录的区间个数，超过容量的部分已被覆盖
+    bool retired;               ///< 线程已退出，只保留已记录的区间
+};
+
+std::mutex registry_mutex;
+/// 线程退出后缓冲区缩小到已记录的区间后仍保留在这里，导出时包含已退出线程的记录
+std::vector<std::shared_ptr<TraceBuffer>> registry;
+size_t buffer_capacity = 1 << 16;
+uint32_t next_tid = 0;
+
+std::atomic<bool> dump_requested(false);
+
+/**
+ * 线程的缓冲区，线程退出时释放没有用到的容量，没有记录的缓冲区直接移除.
+ */
+struct BufferOwner
+{
+    std::shared_ptr<TraceBuffer> buffer;
+
+    ~BufferOwner()
+    {
+        if (!buffer)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        if (buffer->count == 0)
+        {
+            registry.erase(std::remove(registry.begin(), registry.end(), buffer), registry.end());
+        }
+        else
+        {
+            buffer->events.resize(std::min(buffer->count, buffer->events.size()));
+            buffer->events.shrink_to_fit();
+            buffer->retired = true;
+        }
+    }
+};
+
+thread_local BufferOwner local_owner;
+
+TraceBuffer * get_buffer()
+{
+    if (!local_owner.buffer)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        auto buffer = std::make_shared<TraceBuffer>();
+        buffer->tid = next_tid++;
+        buffer->events.resize(buffer_capacity);
+        buffer->count = 0;
+        buffer->retired = false;
+        registry.push_back(buffer);
+        local_owner.buffer = buffer;
+    }
+    return local_owner.buffer.get();
+}
+
+}   // namespace
+
+std::atomic<bool> Tracer::_enabled(false);
+
+void Tracer::start(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    buffer_capacity = std::max<size_t>(capacity, 1);
+
+    // 已退出线程的记录丢弃，仍在运行的线程持锁重置，不会和它们正在进行的写入冲突
+    registry.erase(
+        std::remove_if(
+            registry.begin(),
+            registry.end(),
+            [](const std::shared_ptr<TraceBuffer> &buffer) { return buffer->retired; }
+        ),
+        registry.end()
+    );
+    for (auto &buffer : registry)
+    {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        buffer->events.assign(buffer_capacity, Event());
+        buffer->count = 0;
+    }
+    _enabled.store(true, std::memory_order_release);
+}
+
+void Tracer::record(const char *name, int64_t begin, int64_t end)
+{
+    auto buffer = get_buffer();
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    buffer->events[buffer->count % buffer->events.size()] = {name, begin, end};
+    ++buffer->count;
+}
+
+void Tracer::request_dump()
+{
+    dump_requested.store(true, std::memory_order_relaxed);
+}
+
+bool Tracer::dump_if_requested(const std::string &fname)
+{
+    if (!dump_requested.exchange(false, std::memory_order_relaxed))
+    {
+        return false;
+    }
+
+    return dump(fname);
+}
+
+bool Tracer::dump(std::ostream &os)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    // 导出期间各线程可以继续记录，逐个缓冲区持锁复制，避免长时间阻塞被跟踪的线程
+    std::vector<std::pair<uint32_t, std::vector<Event>>> snapshots;
+    size_t dropped = 0;
+    for (auto &buffer : registry)
+    {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        auto n = std::min(buffer->count, buffer->events.size());
+        snapshots.emplace_back(buffer->tid, std::vector<Event>(buffer->events.begin(), buffer->events.begin() + n));
+        dropped += buffer->count - n;
+    }
+
+    // 时间戳以最早的区间为起点，单位为微秒
+    int64_t origin = INT64_MAX;
+    size_t events = 0;
+    for (auto &snapshot : snapshots)
+    {
+        for (auto &e : snapshot.second)
+        {
+            origin = std::min(origin, e.begin);
+        }
+        events += snapshot.second.size();
+    }
+
+    auto pid = getpid();
+    auto flags = os.flags();
+    auto precision = os.precision();
+    os << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+    bool first = true;
+    for (auto &snapshot : snapshots)
+    {
+        for (auto &e : snapshot.second)
+        {
+            os << (first ? "" : ",") << std::endl
+                << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": " << pid
+                << ", \"tid\": " << snapshot.first
+                << ", \"ts\": " << (e.begin - origin) / 1e3
+                << ", \"dur\": " << (e.end - e.begin) / 1e3 << "}";
+            first = false;
+        }
+    }
+    os << std::endl << "], \"displayTimeUnit\": \"ns\"}" << std::endl;
+    os.flags(flags);
+    os.precision(precision);
+
+    INFO << "dumped " << events << " trace events of " << snapshots.size() << " threads, "
+        << dropped << " overwritten" << std::endl;
+    return static_cast<bool>(os);
+}
+
+bool Tracer::dump(const std::string &fname)
+{
+    std::ofstream os(fname);
+    if (!os)
+    {
+        ERROR << "cannot open " << fname << std::endl;
+        return false;
+    }
+
+    return dump(os);
+}
+
+}   // namespace ime
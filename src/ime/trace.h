@@ -0,0 +1,111 @@
+/**
+ * 结构化的耗时跟踪.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <iostream>
+
+
+namespace ime
+{
+
+/**
+ * 记录各线程的耗时区间（span），导出为 Chrome trace 格式的 JSON，可以用 chrome://tracing 或 Perfetto 查看.
+ *
+ * 每个线程第一次记录时分配自己的环形缓冲区，写满后覆盖最早的区间，线程退出时释放没有用到的容量。
+ * 记录时只锁自己线程的缓冲区，没有竞争；开始记录和导出时逐个持锁，可以在被跟踪的线程运行时调用。
+ * 没有开始记录时，每个区间只有一次原子变量的读取和一次分支，可以一直编译在代码中
+ */
+class Tracer
+{
+public:
+    /**
+     * 开始记录，capacity 为每个线程最多保留的区间个数，同时清空已有的记录.
+     */
+    static void start(size_t capacity = 1 << 16);
+
+    static void stop()
+    {
+        _enabled.store(false, std::memory_order_release);
+    }
+
+    static bool enabled()
+    {
+        return _enabled.load(std::memory_order_acquire);
+    }
+
+    /**
+     * 单调时钟的纳秒数.
+     */
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    /**
+     * 记录当前线程的一个区间，name 必须是静态的字符串.
+     */
+    static void record(const char *name, int64_t begin, int64_t end);
+
+    /**
+     * 以 Chrome trace 的 JSON 格式输出全部线程的区间.
+     */
+    static bool dump(std::ostream &os);
+
+    static bool dump(const std::string &fname);
+
+    /**
+     * 请求导出，只设置标志，可以在信号处理函数中调用.
+     */
+    static void request_dump();
+
+    /**
+     * 有导出请求时把当前的记录写入 fname，由程序在方便的位置定期调用.
+     */
+    static bool dump_if_requested(const std::string &fname);
+
+private:
+    static std::atomic<bool> _enabled;
+};
+
+/**
+ * 作用域内的耗时区间，构造时开始，析构时记录.
+ */
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name_) : name(name_), begin(Tracer::enabled() ? Tracer::now() : 0) {}
+
+    TraceSpan(const TraceSpan &) = delete;
+
+    TraceSpan & operator = (const TraceSpan &) = delete;
+
+    ~TraceSpan()
+    {
+        if (begin != 0)
+        {
+            Tracer::record(name, begin, Tracer::now());
+        }
+    }
+
+private:
+    const char *name;
+    int64_t begin;          ///< 开始时间，0 为没有在记录
+};
+
+}   // namespace ime
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name)    ::ime::TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+
+#endif  // _TRACE_H_
@@ -10,10 +10,16 @@
 
 #include "ime/dict.h"
 #include "ime/decoder.h"
+#include "ime/log.h"
 
 
 int main(int argc, char **argv)
 {
+    if (argc < 3)
+    {
+        ERROR << "usage: " << argv[0] << " DICT_FILE MODEL_FILE" << std::endl;
+        return -1;
+    }
 
     std::string dict_file = argv[1];
     std::string model_file = argv[2];
@@ -6,26 +6,400 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
 #include <iostream>
 #include <chrono>
+#include <csignal>
+
+#include <unistd.h>
 
 #include "ime/common.h"
 #include "ime/dict.h"
+#include "ime/corpus.h"
+#include "ime/checkpoint.h"
+#include "ime/mixing.h"
 #include "ime/decoder.h"
+#include "ime/trace.h"
+
+
+namespace
+{
+
+/**
+ * 提前终止：评估精度连续 patience 次没有超过最好结果时停止训练，patience 为 0 时不停止.
+ */
+class EarlyStopping
+{
+public:
+    explicit EarlyStopping(size_t patience_) : patience(patience_), best(0), count(0) {}
+
+    /**
+     * 记录一次评估结果，返回是否应当停止训练.
+     */
+    bool update(const ime::Metrics &metrics)
+    {
+        auto precision = metrics.get("precision");
+        if (precision > best)
+        {
+            best = precision;
+            count = 0;
+        }
+        else
+        {
+            ++count;
+        }
+
+        return (patience > 0) && (count >= patience);
+    }
+
+private:
+    size_t patience;
+    double best;        ///< 最好的评估精度
+    size_t count;       ///< 连续没有提高的评估次数
+};
+
+/**
+ * 在后台线程用模型快照评估，训练可以同时进行.
+ *
+ * 评估使用单独的线程数，不占用训练的线程，同一时间只有一个评估在进行
+ */
+class AsyncEvaluation
+{
+public:
+    AsyncEvaluation(
+        const ime::Dictionary &dict_,
+        const ime::Corpus &corpus_,
+        size_t batch_size_,
+        size_t threads_
+    ) : dict(dict_), corpus(corpus_), batch_size(batch_size_), threads(threads_), _epoch(0), _seconds(0), result() {}
+
+    ~AsyncEvaluation()
+    {
+        if (result.valid())
+        {
+            result.wait();
+        }
+    }
+
+    /**
+     * 开始评估第 epoch 轮结束时的模型快照，此时不能有未取出结果的评估.
+     */
+    void start(size_t epoch, std::unique_ptr<ime::Model> snapshot)
+    {
+        assert(!result.valid());
+
+        _epoch = epoch;
+        result = std::async(std::launch::async, [this](std::unique_ptr<ime::Model> model)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            // 快照移入解码器，评估期间只比训练多一份模型
+            ime::Decoder evaluator(dict, std::move(*model));
+            model.reset();
+            evaluator.threads(threads);
+
+            ime::Metrics metrics;
+            evaluator.evaluate(corpus, batch_size, metrics);
+            auto stop = std::chrono::high_resolution_clock::now();
+            _seconds = std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count();
+            return metrics;
+        }, std::move(snapshot));
+    }
+
+    /**
+     * 取出评估结果，wait 为 false 时评估尚未完成则立即返回，没有取到结果时返回 false.
+     */
+    bool finish(bool wait, ime::Metrics &metrics)
+    {
+        if (!result.valid()
+            || (!wait && (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)))
+        {
+            return false;
+        }
+
+        metrics = result.get();
+        return true;
+    }
+
+    size_t epoch() const
+    {
+        return _epoch;
+    }
+
+    float seconds() const
+    {
+        return _seconds;
+    }
+
+private:
+    const ime::Dictionary &dict;
+    const ime::Corpus &corpus;
+    size_t batch_size;
+    size_t threads;
+    size_t _epoch;
+    float _seconds;
+    std::future<ime::Metrics> result;
+};
+
+/**
+ * k 折交叉验证的设置，除 folds 和 threads 外和普通训练的选项相同.
+ */
+struct CrossValidation
+{
+    size_t folds;
+    size_t threads;         ///< 各折共享的线程预算
+    size_t epochs;
+    ime::TrainState state;
+    ime::UpdateStrategy strategy;
+    size_t hash_bits;
+    size_t min_count;
+};
+
+/**
+ * k 折交叉验证：样本 i 属于第 i % folds 折，每折用其余各折训练，用该折评估，输出各折的平均指标.
+ *
+ * 各折的模型共享只读的词典（特征取值即词典中的词编号），只载入一次。
+ * 同时训练 min(folds, threads) 折，线程预算在它们之间平均分配，训练完一折再领取下一折，
+ * 同一时间最多有这么多个模型，内存不随折数增长
+ */
+void cross_validate(const ime::Dictionary &dict, const ime::Corpus &corpus, const CrossValidation &cv)
+{
+    auto workers = std::min(cv.folds, std::max<size_t>(cv.threads, 1));
+    std::vector<ime::Metrics> results(cv.folds);
+    std::atomic<size_t> next(0);
+
+    auto run = [&](size_t threads)
+    {
+        for (auto fold = next++; fold < cv.folds; fold = next++)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            ime::Decoder decoder(dict);
+            decoder.threads(threads);
+            decoder.strategy(cv.strategy);
+            decoder.admit(cv.min_count);
+            if (cv.hash_bits > 0)
+            {
+                decoder.hash(cv.hash_bits);
+            }
+
+            ime::EpochScheduler scheduler(corpus, cv.state.seed, cv.state.shuffle);
+            scheduler.batching(cv.state.batch_size, cv.state.bucket_width, cv.state.token_budget);
+            scheduler.holdout(fold, cv.folds);
+            for (size_t epoch = 0; epoch < cv.epochs; ++epoch)
+            {
+                ime::Metrics metrics;
+                auto &order = scheduler.schedule(epoch);
+                decoder.train(corpus, order, scheduler.batches(), metrics);
+            }
+
+            decoder.evaluate(corpus, scheduler.heldout(), cv.state.batch_size, results[fold]);
+            auto stop = std::chrono::high_resolution_clock::now();
+            INFO << "fold " << fold + 1 << " "
+                << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
+                << "s " << results[fold] << std::endl;
+        }
+    };
+
+    // 线程预算不能整除时，前面的工作线程多分一个线程
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < workers; ++i)
+    {
+        pool.emplace_back(run, cv.threads / workers + ((i < cv.threads % workers) ? 1 : 0));
+    }
+    for (auto &t : pool)
+    {
+        t.join();
+    }
+
+    ime::Metrics average;
+    for (auto &i : results.front())
+    {
+        double sum = 0;
+        for (auto &metrics : results)
+        {
+            sum += metrics.get(i.first);
+        }
+        average.set(i.first, sum / cv.folds);
+    }
+
+    double variance = 0;
+    for (auto &metrics : results)
+    {
+        auto d = metrics.get("precision") - average.get("precision");
+        variance += d * d;
+    }
+    average.set("precision stddev", std::sqrt(variance / cv.folds));
+
+    INFO << cv.folds << "-fold cross validation " << average << std::endl;
+}
+
+void usage(const char *prog)
+{
+    ERROR << "usage: " << prog << " [OPTIONS] DICT_FILE TRAIN_FILE EVAL_FILE MODEL_FILE" << std::endl
+        << "  -e EPOCHS      number of epochs (default 2)" << std::endl
+        << "  -b BATCH_SIZE  samples per batch (default 100)" << std::endl
+        << "  -s SEED        seed of the per-epoch shuffle (default 1)" << std::endl
+        << "  -n             keep the corpus order instead of shuffling" << std::endl
+        << "  -w WIDTH       batch samples by code length buckets of WIDTH" << std::endl
+        << "  -t TOKENS      limit total code length per batch instead of BATCH_SIZE" << std::endl
+        << "  -c CHECKPOINT  write checkpoints to CHECKPOINT in the background" << std::endl
+        << "  -i INTERVAL    batches between checkpoints (default 1000)" << std::endl
+        << "  -r             resume from CHECKPOINT if it exists" << std::endl
+        << "  -u STRATEGY    update strategy, early or max-violation (default early)" << std::endl
+        << "  -T THREADS     training threads (default 8)" << std::endl
+        << "  -P PROCESSES   train with PROCESSES worker processes and parameter mixing" << std::endl
+        << "  -S BATCHES     batches per worker between parameter mixing (default 0, once per epoch)" << std::endl
+        << "  -E THREADS     evaluate a model snapshot with THREADS threads while training" << std::endl
+        << "  -p PATIENCE    stop after PATIENCE evaluations without improvement" << std::endl
+        << "  -H HASH_BITS   use a hashed feature space of 2^HASH_BITS slots" << std::endl
+        << "  -m MIN_COUNT   admit a new feature after MIN_COUNT updates" << std::endl
+        << "  -x TRACE_FILE  write a Chrome trace of the last spans of each thread to TRACE_FILE,"
+        << " also on SIGUSR1 while training" << std::endl
+        << "  -k FOLDS       FOLDS-fold cross validation on TRAIN_FILE sharing the THREADS budget,"
+        << " EVAL_FILE and MODEL_FILE are not needed" << std::endl;
+}
+
+void on_dump_signal(int)
+{
+    ime::Tracer::request_dump();
+}
+
+}   // namespace
 
 
 int main(int argc, char **argv)
 {
-    if (argc < 5)
+    size_t epochs = 2;
+    size_t batch_size = 100;
+    uint64_t seed = 1;
+    bool shuffle = true;
+    // 按编码长度分桶组成批次，0 为不分桶
+    size_t bucket_width = 0;
+    // 每批编码总长度的上限，0 为按 batch_size 的样本个数组成批次
+    size_t token_budget = 0;
+    // 检查点文件，为空时不保存检查点
+    std::string checkpoint_file;
+    // 每训练 checkpoint_interval 批保存一次检查点，每轮结束时也保存
+    size_t checkpoint_interval = 1000;
+    bool resume = false;
+    auto strategy = ime::UpdateStrategy::EARLY;
+    size_t train_threads = 8;
+    // 大于 1 时 fork 出这么多工作进程，各自训练一部分批次，定期混合参数
+    size_t processes = 1;
+    // 每个工作进程每训练 sync_interval 批混合一次参数，0 为只在每轮结束时混合
+    size_t sync_interval = 0;
+    // 大于 0 时用这么多线程在后台评估每轮结束时的模型快照，同时继续训练下一轮
+    size_t eval_threads = 0;
+    // 评估精度连续 patience 次没有提高时提前终止，0 为不终止
+    size_t patience = 0;
+    // 指定时使用 2^hash_bits 个槽位的哈希特征空间，模型内存固定
+    size_t hash_bits = 0;
+    // 新特征的更新次数达到 min_count 才创建权重
+    size_t min_count = 0;
+    // 大于 1 时在训练语料上做 k 折交叉验证，不训练最终模型
+    size_t folds = 0;
+    // 指定时记录解码、训练和载入的耗时区间，结束时以 Chrome trace 格式写入
+    std::string trace_file;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:b:s:nw:t:c:i:ru:T:P:S:E:p:H:m:k:x:")) != -1)
     {
-        ERROR << "usage: " << argv[0] << " DICT_FILE, TRAIN_FILE, EVAL_FILE" << std::endl;
+        switch (opt)
+        {
+        case 'e':
+            epochs = std::stoul(optarg);
+            break;
+        case 'b':
+            batch_size = std::stoul(optarg);
+            break;
+        case 's':
+            seed = std::stoull(optarg);
+            break;
+        case 'n':
+            shuffle = false;
+            break;
+        case 'w':
+            bucket_width = std::stoul(optarg);
+            break;
+        case 't':
+            token_budget = std::stoul(optarg);
+            break;
+        case 'c':
+            checkpoint_file = optarg;
+            break;
+        case 'i':
+            checkpoint_interval = std::max<size_t>(std::stoul(optarg), 1);
+            break;
+        case 'r':
+            resume = true;
+            break;
+        case 'u':
+            if (std::string(optarg) == "early")
+            {
+                strategy = ime::UpdateStrategy::EARLY;
+            }
+            else if (std::string(optarg) == "max-violation")
+            {
+                strategy = ime::UpdateStrategy::MAX_VIOLATION;
+            }
+            else
+            {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'T':
+            train_threads = std::stoul(optarg);
+            break;
+        case 'P':
+            processes = std::max<size_t>(std::stoul(optarg), 1);
+            break;
+        case 'S':
+            sync_interval = std::stoul(optarg);
+            break;
+        case 'E':
+            eval_threads = std::stoul(optarg);
+            break;
+        case 'p':
+            patience = std::stoul(optarg);
+            break;
+        case 'H':
+            hash_bits = std::stoul(optarg);
+            break;
+        case 'm':
+            min_count = std::stoul(optarg);
+            break;
+        case 'k':
+            folds = std::stoul(optarg);
+            break;
+        case 'x':
+            trace_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if ((argc - optind < ((folds > 1) ? 2 : 4)) || (resume && checkpoint_file.empty()))
+    {
+        usage(argv[0]);
         return -1;
     }
 
-    std::string dict_file = argv[1];
-    std::string train_file = argv[2];
-    std::string eval_file = argv[3];
-    std::string model_file = argv[4];
+    std::string dict_file = argv[optind];
+    std::string train_file = argv[optind + 1];
+
+    if (!trace_file.empty())
+    {
+        // 收到 SIGUSR1 后在下一批结束时导出，不必等到训练结束
+        ime::Tracer::start();
+        std::signal(SIGUSR1, on_dump_signal);
+    }
 
     auto start = std::chrono::high_resolution_clock::now();
     ime::Dictionary dict(dict_file, 20);
@@ -34,32 +408,247 @@ int main(int argc, char **argv)
         << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
         << "s" << std::endl;
 
+    start = stop;
+    ime::Corpus train_corpus;
+    if (!train_corpus.open_text(train_file))
+    {
+        return -1;
+    }
+
+    if (folds > 1)
+    {
+        ime::TrainState state = {seed, shuffle, batch_size, bucket_width, token_budget, 0, 0};
+        cross_validate(dict, train_corpus, {folds, train_threads, epochs, state, strategy, hash_bits, min_count});
+        if (!trace_file.empty())
+        {
+            ime::Tracer::stop();
+            ime::Tracer::dump(trace_file);
+        }
+        return 0;
+    }
+
+    std::string eval_file = argv[optind + 2];
+    std::string model_file = argv[optind + 3];
+    ime::Corpus eval_corpus;
+    if (!eval_corpus.open_text(eval_file))
+    {
+        return -1;
+    }
+    stop = std::chrono::high_resolution_clock::now();
+    INFO << "load corpus "
+        << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
+        << "s" << std::endl;
+
     ime::Decoder decoder(dict);
+    decoder.threads(train_threads);
+    decoder.strategy(strategy);
+    decoder.admit(min_count);
 
-    size_t epochs = 2;
-    size_t batch_size = 100;
-    for (size_t epoch = 0; epoch < epochs; ++epoch)
+    ime::TrainState state = {seed, shuffle, batch_size, bucket_width, token_budget, 0, 0};
+    std::unique_ptr<ime::Checkpointer> checkpointer;
+    if (!checkpoint_file.empty())
+    {
+        checkpointer.reset(new ime::Checkpointer(checkpoint_file));
+    }
+
+    // 恢复时沿用检查点的种子和批次设置，以重新生成相同的样本顺序
+    // 还没有检查点时（比如第一次运行就带了 -r）从头开始训练，只有检查点损坏才退出
+    if (resume && !checkpointer->exists())
+    {
+        INFO << "no checkpoint " << checkpoint_file << ", start from epoch 1" << std::endl;
+        resume = false;
+    }
+
+    if (resume && !decoder.resume(*checkpointer, state))
+    {
+        return -1;
+    }
+    else if (!resume && (hash_bits > 0))
+    {
+        decoder.hash(hash_bits);
+    }
+
+    // 多进程训练时工作进程只负责训练，协调进程混合参数，并负责检查点、评估和保存模型
+    std::unique_ptr<ime::ParameterMixer> mixer;
+    size_t worker = 0;
+    if (processes > 1)
+    {
+        if (state.batch > 0)
+        {
+            ERROR << "cannot resume from the middle of an epoch with multiple processes" << std::endl;
+            return -1;
+        }
+
+        mixer = ime::ParameterMixer::spawn(processes, worker);
+        if (!mixer)
+        {
+            return -1;
+        }
+        decoder.begin_mixing(*mixer);
+    }
+    bool training = !mixer || !mixer->coordinator();
+    bool leader = !mixer || mixer->coordinator();
+
+    EarlyStopping early_stopping(patience);
+    bool stopped = false;
+    std::unique_ptr<AsyncEvaluation> evaluation;
+    if (eval_threads > 0)
+    {
+        evaluation.reset(new AsyncEvaluation(dict, eval_corpus, batch_size, eval_threads));
+    }
+
+    // 截至每一轮结束的累计训练耗时（不含评估），和评估结果一起输出，用于比较不同策略的收敛速度
+    std::vector<double> train_hours(epochs, 0);
+    double train_seconds = 0;
+
+    auto report = [&](size_t epoch, float seconds, ime::Metrics metrics)
+    {
+        metrics.set("train hours", train_hours[epoch]);
+        INFO << "epoch " << epoch + 1 << " evaluate " << seconds << "s " << metrics << std::endl;
+        if (early_stopping.update(metrics))
+        {
+            INFO << "early stopping, no improvement in " << patience << " evaluations" << std::endl;
+            stopped = true;
+        }
+    };
+
+    // 取出后台评估的结果，wait 为 false 时只在评估已完成时输出
+    auto collect = [&](bool wait)
     {
         ime::Metrics metrics;
+        if (evaluation && evaluation->finish(wait, metrics))
+        {
+            report(evaluation->epoch(), evaluation->seconds(), metrics);
+        }
+    };
+
+    ime::EpochScheduler scheduler(train_corpus, state.seed, state.shuffle);
+    scheduler.batching(state.batch_size, state.bucket_width, state.token_budget);
+    for (size_t epoch = state.epoch; (epoch < epochs) && !stopped; ++epoch)
+    {
+        ime::Metrics metrics;
+
+        auto &order = scheduler.schedule(epoch);
+        // 中途混合只在每个工作进程都还有批次时进行，各进程的混合次数相同
+        auto shard_batches = (scheduler.batches().size() - 1) / processes;
+        auto syncs = ((sync_interval > 0) && (shard_batches > 0)) ? (shard_batches - 1) / sync_interval : 0;
+        if (mixer && training)
+        {
+            scheduler.shard(worker, processes);
+        }
+
+        auto &batches = scheduler.batches();
+        auto first_batch = (epoch == state.epoch) ? state.batch : 0;
+        auto on_batch = [&](size_t batch)
+        {
+            if (mixer)
+            {
+                if ((sync_interval > 0)
+                    && (batch % sync_interval == 0)
+                    && (batch / sync_interval <= syncs)
+                    && !decoder.mix(*mixer))
+                {
+                    stopped = true;
+                }
+            }
+            else if (checkpointer
+                && (batch % checkpoint_interval == 0)
+                && (batch + 1 < batches.size()))
+            {
+                state.epoch = epoch;
+                state.batch = batch;
+                checkpointer->save(decoder.snapshot(), state);
+            }
 
-        start = stop;
-        decoder.train(train_file, metrics, batch_size);
-        stop = std::chrono::high_resolution_clock::now();
+            if (!trace_file.empty())
+            {
+                ime::Tracer::dump_if_requested(trace_file);
+            }
 
-        INFO << "epoch " << epoch + 1 << " train "
-            << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
-            << "s " << metrics << std::endl;
+            collect(false);
+            return !stopped;
+        };
 
-        metrics.clear();
-        start = stop;
-        decoder.evaluate(eval_file, metrics, batch_size);
-        stop = std::chrono::high_resolution_clock::now();
+        // 重新取时间，上一轮末尾的检查点和等待评估不计入训练耗时
+        start = std::chrono::high_resolution_clock::now();
+        if (training)
+        {
+            decoder.train(train_corpus, order, batches, metrics, first_batch, on_batch);
+            if (mixer && !stopped && !decoder.mix(*mixer))
+            {
+                stopped = true;
+            }
+            stop = std::chrono::high_resolution_clock::now();
 
-        INFO << "evaluate "
-            << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
-            << "s " << metrics << std::endl;
+            INFO << (mixer ? "worker " + std::to_string(worker) + " " : std::string())
+                << "epoch " << epoch + 1 << " train "
+                << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
+                << "s " << metrics << std::endl;
+        }
+        else
+        {
+            for (size_t i = 0; (i <= syncs) && !stopped; ++i)
+            {
+                if (!decoder.mix(*mixer))
+                {
+                    stopped = true;
+                }
+            }
+            stop = std::chrono::high_resolution_clock::now();
+
+            INFO << "epoch " << epoch + 1 << " train "
+                << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
+                << "s, " << processes << " workers, mixed " << syncs + 1 << " times" << std::endl;
+        }
+
+        train_seconds += std::chrono::duration_cast<std::chrono::duration<double>>(stop - start).count();
+        train_hours[epoch] = train_seconds / 3600;
+
+        if (stopped)
+        {
+            break;
+        }
+
+        if (!leader)
+        {
+            continue;
+        }
+
+        if (checkpointer)
+        {
+            state.epoch = epoch + 1;
+            state.batch = 0;
+            checkpointer->save(decoder.snapshot(), state);
+        }
+
+        if (evaluation)
+        {
+            // 上一轮的评估比这一轮的训练慢时在这里等待
+            collect(true);
+            if (!stopped)
+            {
+                evaluation->start(epoch, decoder.snapshot());
+            }
+            stop = std::chrono::high_resolution_clock::now();
+        }
+        else
+        {
+            metrics.clear();
+            start = stop;
+            decoder.evaluate(eval_corpus, batch_size, metrics);
+            stop = std::chrono::high_resolution_clock::now();
+            report(epoch, std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count(), metrics);
+        }
+    }
+
+    if (!leader)
+    {
+        return 0;
     }
 
+    collect(true);
+    stop = std::chrono::high_resolution_clock::now();
+
     start = stop;
     decoder.save(model_file);
     stop = std::chrono::high_resolution_clock::now();
@@ -67,5 +656,16 @@ int main(int argc, char **argv)
         << std::chrono::duration_cast<std::chrono::duration<float>>(stop - start).count()
         << "s" << std::endl;
 
+    if (checkpointer)
+    {
+        checkpointer->wait();
+    }
+
+    if (!trace_file.empty())
+    {
+        ime::Tracer::stop();
+        ime::Tracer::dump(trace_file);
+    }
+
     return 0;
 }